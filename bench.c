@@ -0,0 +1,629 @@
+/* microsynth - Evaluation benchmarks
+ *
+ * Without arguments, the microbenchmark builds a patch with hundreds of variable references and reports the cost
+ * per frame of:
+ *  - resolving every variable reference by name, the hash lookups each
+ *    frame paid before references were bound by ssv_regroup,
+ *  - evaluating all variables sample by sample (bound references),
+ *  - evaluating all variables a block at a time.
+ *
+ * The block evaluation of a patch with many independent variables is then
+ * timed with a single thread and with a pool of BENCH_THREADS threads.
+ *
+ * Finally it reports how long scheduling a patch with many more variables
+ * (ssv_regroup) takes, and how long checking and assigning a single edit
+ * to that patch takes before it is regrouped, and how the cost per frame
+ * of a recursive patch develops while it decays into silence, with and
+ * without flushing denormals to zero.
+ *
+ * With patch files as arguments, every patch is rendered headless for a
+ * fixed amount of seconds in a child process, and a CSV line reporting the
+ * time per sample, the realtime factor and the peak RSS of the child is
+ * written for every patch. Patch files are read as follows:
+ *  - Files containing a microsynth prompt ("msynth> ") are sessions, the
+ *    lines typed at the prompt form a single patch.
+ *  - Otherwise, paragraphs whose first line ends in ':' form a single patch
+ *    named by that line, every line of other paragraphs is a patch.
+ *
+ * Usage: microsynth-bench [-j] [-t threads] [-l seconds] [patch files]
+ */
+
+/* POSIX */
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* C-stdlib */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+/* GLib */
+#include <glib.h>
+
+/* microsynth stuff */
+#include "main.h"
+#include "sampleclock.h"
+#include "synth.h"
+#include "soundscript.h"
+#include "tape.h"
+#include "pool.h"
+#include "gen.h"
+#include "rt.h"
+
+#define BENCH_VARS      256
+#define BENCH_FRAMES    (48000 * 4)
+#define BENCH_REGROUP   10000
+#define BENCH_EDITS     1000
+#define BENCH_WIDE      64
+#define BENCH_THREADS   4
+#define BENCH_PROMPT    "msynth> "
+#define BENCH_DECAY     8       /* Seconds of silence rendered */
+
+struct _msynth_config config;
+
+/* Recursive patch decaying into silence, once in is silenced */
+static char *bench_decay_patch[] = {
+    "in := square(50) * 0.5",
+    "filter = in * 0.2 + filter[1] * 0.8",
+    "reverb = filter[1] + 0.45 * (reverb[10] + reverb[100])",
+    "left := reverb[1]",
+    NULL
+};
+
+/* A patch read from a patch file */
+struct bench_patch {
+    char *file;
+    char *name;
+    GPtrArray *lines;
+};
+
+static void bench_build_patch(void);
+static void bench_collect_refs(msynth_modifier mod, GPtrArray *names);
+static double bench_now(void);
+static double bench_regroup(void);
+static double bench_edit(char *vname, char *a, char *b);
+static void bench_build_wide(void);
+static double bench_block(void);
+static int bench_micro(void);
+static void bench_add_patch(GPtrArray *patches, char *file, char *name,
+    GPtrArray *lines);
+static int bench_read_patches(char *file, GPtrArray *patches);
+static double bench_render(struct bench_patch *patch, float seconds);
+static int bench_patch(struct bench_patch *patch, float seconds);
+static void bench_csv(char *field);
+static void bench_decay(int flush);
+
+/* Build patch, every variable reads a few of the previous ones */
+static void bench_build_patch(void)
+{
+    char line[256];
+    int k;
+
+    soundscript_parse("v0 := sin(110)");
+    for (k = 1; k < BENCH_VARS; k++) {
+        snprintf(line, sizeof(line),
+            "v%i := (v%i + v%i) * 0.5 + v%i * 0.25 - v%i * 0.125",
+            k, k - 1, k / 2, k / 3, k / 4);
+        soundscript_parse(line);
+    }
+
+    snprintf(line, sizeof(line), "left := v%i", BENCH_VARS - 1);
+    soundscript_parse(line);
+    snprintf(line, sizeof(line), "right := v%i * 0.5", BENCH_VARS - 2);
+    soundscript_parse(line);
+
+    return;
+}
+
+/* Build patch of independent variables, mixed by a few sums */
+static void bench_build_wide(void)
+{
+    char line[256];
+    int k;
+
+    for (k = 0; k < BENCH_WIDE; k++) {
+        snprintf(line, sizeof(line),
+            "w%i := sin(%i + 110) * saw(%i) + triangle(%i) * square(3) * 0.5",
+            k, k * 7, k + 1, k * 3 + 55);
+        soundscript_parse(line);
+    }
+
+    for (k = 0; k < BENCH_WIDE; k += 8) {
+        snprintf(line, sizeof(line),
+            "s%i := w%i + w%i + w%i + w%i + w%i + w%i + w%i + w%i", k / 8,
+            k, k + 1, k + 2, k + 3, k + 4, k + 5, k + 6, k + 7);
+        soundscript_parse(line);
+    }
+
+    soundscript_parse("left := (s0 + s1 + s2 + s3 + s4 + s5 + s6 + s7) * 0.01");
+    soundscript_parse("right := left");
+
+    return;
+}
+
+/* Time block evaluation of the current patch */
+static double bench_block(void)
+{
+    double start;
+    int i, frames;
+
+    start = bench_now();
+    for (i = 0; i < BENCH_FRAMES; i += frames) {
+        frames = BENCH_FRAMES - i;
+        if (frames > MSYNTH_BLOCK)
+            frames = MSYNTH_BLOCK;
+        ssv_eval_block(sc_from_samples(48000, i), frames);
+    }
+
+    return bench_now() - start;
+}
+
+/* Collect the names of all variable references in graph */
+static void bench_collect_refs(msynth_modifier mod, GPtrArray *names)
+{
+    switch(mod->type) {
+        case MSMT_VARIABLE:
+            g_ptr_array_add(names, mod->data.variable.name);
+            break;
+
+        case MSMT_NODE1:
+            bench_collect_refs(mod->data.node.in, names);
+            break;
+
+        case MSMT_NODE2:
+            bench_collect_refs(mod->data.node2.a, names);
+            bench_collect_refs(mod->data.node2.b, names);
+            break;
+
+        default:;
+    }
+
+    return;
+}
+
+/* Monotonic time in seconds */
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Add a chain of variables to the patch and time regrouping it */
+static double bench_regroup(void)
+{
+    char vname[16];
+    msynth_modifier mod;
+    double start;
+    int k;
+
+    for (k = 0; k < BENCH_REGROUP; k++) {
+        if (k) {
+            snprintf(vname, sizeof(vname), "r%i", k / 2);
+            mod = ssb_variable(vname);
+            snprintf(vname, sizeof(vname), "r%i", k - 1);
+            mod = ssb_add(ssb_mul(ssb_variable(vname), ssb_number(0.5)),
+                mod);
+        } else {
+            mod = ssb_func0("whitenoise");
+        }
+
+        snprintf(vname, sizeof(vname), "r%i", k);
+        ssv_set_var(vname, mod);
+    }
+
+    start = bench_now();
+    ssv_regroup();
+    return bench_now() - start;
+}
+
+/* Time checking and assigning vname := a * 0.25 + b, without regrouping */
+static double bench_edit(char *vname, char *a, char *b)
+{
+    msynth_modifier mod;
+    double start;
+    int k;
+
+    start = bench_now();
+    for (k = 0; k < BENCH_EDITS; k++) {
+        mod = ssb_add(ssb_mul(ssb_variable(a), ssb_number(0.25)),
+            ssb_variable(b));
+
+        if (ssv_speculate_cycle(vname, mod))
+            synth_free_recursive(mod);
+        else
+            ssv_set_var(vname, mod);
+    }
+
+    return (bench_now() - start) / BENCH_EDITS;
+}
+
+static int bench_micro(void)
+{
+    GPtrArray *names;
+    char vname[16];
+    double start, lookup, sample, block, wide, wide_pool;
+    double regroup, edit, cycle;
+    volatile float sink = 0.0f;
+    int i, k;
+
+    config.srate = 48000;
+
+    /* Setup soundscript, without starting the synth thread */
+    soundscript_init();
+    ssv_set_var("right", ssb_number(0.));
+    ssv_set_var("left", ssb_number(0.));
+    ssv_regroup();
+
+    bench_build_patch();
+
+    names = g_ptr_array_new();
+    for (k = 0; k < BENCH_VARS; k++) {
+        snprintf(vname, sizeof(vname), "v%i", k);
+        bench_collect_refs(ssv_get_var(vname)->vargraph, names);
+    }
+
+    /* Name lookups of all references */
+    start = bench_now();
+    for (i = 0; i < BENCH_FRAMES; i++)
+        for (k = 0; k < names->len; k++)
+            sink += ssv_get_var_eval(g_ptr_array_index(names, k));
+    lookup = bench_now() - start;
+
+    /* Sample by sample evaluation */
+    start = bench_now();
+    for (i = 0; i < BENCH_FRAMES; i++)
+        ssv_eval(sc_from_samples(48000, i));
+    sample = bench_now() - start;
+
+    /* Block evaluation */
+    block = bench_block();
+
+    printf("%i variables, %i references, %i frames\n", BENCH_VARS,
+        names->len, BENCH_FRAMES);
+    printf("name lookups:        %8.1f ns/frame\n",
+        lookup * 1e9 / BENCH_FRAMES);
+    printf("per sample (bound):  %8.1f ns/frame\n",
+        sample * 1e9 / BENCH_FRAMES);
+    printf("per sample (lookup): %8.1f ns/frame (estimated)\n",
+        (sample + lookup) * 1e9 / BENCH_FRAMES);
+    printf("block:               %8.1f ns/frame\n",
+        block * 1e9 / BENCH_FRAMES);
+
+    /* Independent variables, single thread and pool */
+    bench_build_wide();
+    wide = bench_block();
+
+    pool_init(BENCH_THREADS);
+    ssv_regroup();
+    wide_pool = bench_block();
+    pool_shutdown();
+    ssv_regroup();
+
+    printf("block (wide):        %8.1f ns/frame (%i variables, %s)\n",
+        wide * 1e9 / BENCH_FRAMES, BENCH_WIDE, gen_kernels_name());
+    printf("wavetables:          %8lu KiB (shared)\n",
+        (unsigned long)gen_wavetables_size() / 1024);
+    printf("graph nodes:         %8lu KiB (reserved)\n",
+        (unsigned long)synth_reserved() / 1024);
+    printf("block (wide, pool):  %8.1f ns/frame (%i threads)\n",
+        wide_pool * 1e9 / BENCH_FRAMES, BENCH_THREADS);
+
+    regroup = bench_regroup();
+    printf("regroup:             %8.1f ms (%i variables)\n",
+        regroup * 1e3, BENCH_VARS + BENCH_REGROUP + 2);
+
+    edit = bench_edit("r5000", "r4999", "r10");
+    cycle = bench_edit("r5000", "r9999", "r10");
+    ssv_regroup();
+    printf("edit:                %8.1f us\n", edit * 1e6);
+    printf("edit (cycle):        %8.1f us (rejected)\n", cycle * 1e6);
+
+    bench_decay(0);
+    bench_decay(1);
+
+    g_ptr_array_free(names, TRUE);
+    soundscript_shutdown();
+
+    return EXIT_SUCCESS;
+}
+
+/* Time a recursive patch decaying into silence, a second at a time, in a
+ * child process flushing denormals to zero (flush is 1) or not
+ */
+static void bench_decay(int flush)
+{
+    double start, elapsed[BENCH_DECAY + 1];
+    pid_t pid;
+    int i, k;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return;
+    }
+
+    if (pid) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    if (rt_flush_denormals(flush))
+        _exit(EXIT_FAILURE);
+
+    soundscript_init();
+    msynth_init_offline();
+    for (i = 0; bench_decay_patch[i]; i++)
+        soundscript_parse(bench_decay_patch[i]);
+
+    /* A second of sound, then silence */
+    for (k = 0; k <= BENCH_DECAY; k++) {
+        if (k == 1)
+            soundscript_parse("in := 0");
+
+        start = bench_now();
+        for (i = 0; i < 48000; i += MSYNTH_BLOCK)
+            ssv_eval_block(sc_from_samples(48000, k * 48000 + i),
+                MSYNTH_BLOCK);
+        elapsed[k] = bench_now() - start;
+    }
+
+    printf("decay (%s):", flush ? "flushed " : "denormal");
+    for (k = 0; k <= BENCH_DECAY; k++)
+        printf(k == 1 ? " | %5.1f" : " %5.1f", elapsed[k] * 1e9 / 48000);
+    printf(" ns/frame (sound | silence)\n");
+
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+/* Add a patch, lines are copied */
+static void bench_add_patch(GPtrArray *patches, char *file, char *name,
+    GPtrArray *lines)
+{
+    struct bench_patch *patch;
+    int i;
+
+    if (!lines->len)
+        return;
+
+    patch = malloc(sizeof(struct bench_patch));
+    assert(patch);
+    patch->file = file;
+    patch->name = strdup(name);
+    patch->lines = g_ptr_array_new();
+    for (i = 0; i < lines->len; i++)
+        g_ptr_array_add(patch->lines, strdup(g_ptr_array_index(lines, i)));
+    g_ptr_array_add(patches, patch);
+
+    return;
+}
+
+/* Read all patches from a patch file, returns -1 if it cannot be read */
+static int bench_read_patches(char *file, GPtrArray *patches)
+{
+    FILE *in;
+    GPtrArray *lines, *para;
+    char *line = NULL, *title = NULL, name[64];
+    size_t alloc = 0;
+    ssize_t len;
+    int i, session = 0;
+
+    in = fopen(file, "r");
+    if (!in) {
+        perror(file);
+        return -1;
+    }
+
+    /* Read all lines, and check whether this is a session */
+    lines = g_ptr_array_new();
+    while ((len = getline(&line, &alloc, in)) != -1) {
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (!strncmp(line, BENCH_PROMPT, strlen(BENCH_PROMPT)))
+            session = 1;
+        g_ptr_array_add(lines, strdup(line));
+    }
+    free(line);
+    fclose(in);
+
+    para = g_ptr_array_new();
+    if (session) {
+        /* Only lines typed at the prompt */
+        for (i = 0; i < lines->len; i++) {
+            line = g_ptr_array_index(lines, i);
+            if (!strncmp(line, BENCH_PROMPT, strlen(BENCH_PROMPT)))
+                g_ptr_array_add(para, line + strlen(BENCH_PROMPT));
+        }
+        bench_add_patch(patches, file, "session", para);
+    } else {
+        /* Paragraphs, an empty line is appended to end the last one */
+        g_ptr_array_add(lines, strdup(""));
+        for (i = 0; i < lines->len; i++) {
+            line = g_ptr_array_index(lines, i);
+            len = strlen(line);
+
+            if (!len) {
+                if (title)
+                    bench_add_patch(patches, file, title, para);
+                g_ptr_array_set_size(para, 0);
+                title = NULL;
+
+            /* Titled paragraph */
+            } else if (!para->len && !title && line[len - 1] == ':') {
+                line[len - 1] = '\0';
+                title = line;
+
+            } else if (title) {
+                g_ptr_array_add(para, line);
+
+            /* One-liner, named by its line number */
+            } else {
+                g_ptr_array_add(para, line);
+                snprintf(name, sizeof(name), "line %i", i + 1);
+                bench_add_patch(patches, file, name, para);
+                g_ptr_array_set_size(para, 0);
+            }
+        }
+    }
+
+    g_ptr_array_free(para, TRUE);
+    for (i = 0; i < lines->len; i++)
+        free(g_ptr_array_index(lines, i));
+    g_ptr_array_free(lines, TRUE);
+
+    return 0;
+}
+
+/* Setup patch and render it without output, returns the time spent
+ * rendering
+ */
+static double bench_render(struct bench_patch *patch, float seconds)
+{
+    double start;
+    int i, frames, total = (int)(seconds * config.srate);
+
+    soundscript_init();
+    msynth_init_offline();
+    for (i = 0; i < patch->lines->len; i++)
+        soundscript_parse(g_ptr_array_index(patch->lines, i));
+
+    start = bench_now();
+    for (i = 0; i < total; i += frames) {
+        frames = total - i;
+        if (frames > MSYNTH_BLOCK)
+            frames = MSYNTH_BLOCK;
+        ssv_eval_block(sc_from_samples(config.srate, i), frames);
+    }
+
+    return bench_now() - start;
+}
+
+/* Benchmark a patch in a child process, and write its CSV line */
+static int bench_patch(struct bench_patch *patch, float seconds)
+{
+    struct rusage usage;
+    double elapsed;
+    int fds[2], status;
+    pid_t pid;
+
+    if (pipe(fds)) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    /* Child: render and report the time spent, messages go to stderr */
+    if (!pid) {
+        close(fds[0]);
+        dup2(2, 1);
+        pool_init(config.threads);
+        elapsed = bench_render(patch, seconds);
+        pool_shutdown();
+        if (write(fds[1], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+        elapsed = -1.0;
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &usage) == -1 || elapsed < 0.0) {
+        fprintf(stderr, "%s: %s: benchmark failed\n", patch->file,
+            patch->name);
+        return -1;
+    }
+
+    /* file,patch,engine,threads,seconds,ns_per_sample,realtime,peak_rss_kb */
+    bench_csv(patch->file);
+    bench_csv(patch->name);
+    printf("%s,%i,%.1f,%.1f,%.1f,%li\n",
+        tape_get_engine() == TAPE_ENGINE_NATIVE ? "native" : "tape",
+        config.threads, seconds, elapsed * 1e9 / (seconds * config.srate),
+        elapsed > 0.0 ? seconds / elapsed : 0.0, usage.ru_maxrss);
+
+    return 0;
+}
+
+/* Write CSV field followed by a comma, quoted if necessary */
+static void bench_csv(char *field)
+{
+    if (!strpbrk(field, ",\"\n")) {
+        printf("%s,", field);
+        return;
+    }
+
+    putchar('"');
+    for (; *field; field++) {
+        if (*field == '"')
+            putchar('"');
+        putchar(*field);
+    }
+    printf("\",");
+
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    GPtrArray *patches;
+    float seconds = 10.0f;
+    int arg, i, failed = 0;
+
+    config.threads = 1;
+    while ((arg = getopt(argc, argv, "jt:l:")) != -1) {
+        switch (arg) {
+            case 'j':
+                if (tape_set_engine(TAPE_ENGINE_NATIVE))
+                    fprintf(stderr, "Native code is not supported on this"
+                        " platform, using tape interpreter\n");
+                break;
+
+            case 't':
+                config.threads = atoi(optarg) < 1 ? 1 : atoi(optarg);
+                break;
+
+            case 'l':
+                seconds = atof(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-t threads] [-l seconds]"
+                    " [patch files]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc)
+        return bench_micro();
+
+    config.srate = 48000;
+
+    patches = g_ptr_array_new();
+    for (i = optind; i < argc; i++)
+        if (bench_read_patches(argv[i], patches))
+            failed = 1;
+
+    printf("file,patch,engine,threads,seconds,ns_per_sample,realtime,"
+        "peak_rss_kb\n");
+    for (i = 0; i < patches->len; i++)
+        if (bench_patch(g_ptr_array_index(patches, i), seconds))
+            failed = 1;
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 /* microsynth - Basic waveform generation */
 
 /* C-stdlib */
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
@@ -10,50 +11,346 @@
 #include "gen.h"
 
 #ifndef M_PI
-#define M_PI 3.14159265358f
+#define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
 #endif
 
 /* Oscillator local storage
  *
- * Contains the local clock and previous frequency
+ * Contains the phase, a 32 bit fixed point fraction of a cycle which wraps
+ * around by itself, its latest increment per sample and the sample it was
+ * last advanced to. Storage is allocated zeroed along with the graph node,
+ * the oscillator starts on its first evaluation.
  */
 typedef struct _osc_local {
-    float
-        cycle,
-        prev_seconds;
+    uint32_t
+        phase,
+        increment;
+    int64_t prev_samples;
+    int started;
 } *osc_local;
 
+/* Whitenoise local storage
+ *
+ * Noise is a hash of the seed of the node and the sample clock (a counter
+ * based generator): every node has a sequence of its own, the same no
+ * matter in which order or on which thread nodes are evaluated, and a
+ * block is generated without carrying anything from sample to sample.
+ * Seeds are handed out in order of node creation, so renders of the same
+ * script are identical.
+ */
+typedef struct _noise_local {
+    uint32_t seed;
+} *noise_local;
+
+/* Seeds handed out so far */
+static uint32_t noise_seeds = 0;
+
+/* Noise hash output to samples in [-1, 1] */
+#define GEN_NOISE_SCALE 4.656612873077393e-10f
+
+/* A cycle in phase units, and its inverse */
+#define GEN_PHASE_CYCLE 4294967296.0
+#define GEN_PHASE_SCALE 2.3283064365386963e-10f
+
+/* Frames of phases a block oscillator accumulates at a time */
+#define GEN_CHUNK 64
+
+/* Sine polynomial coefficients, see _gen_sin_cycle */
+#define GEN_SIN_C1 3.14159258f
+#define GEN_SIN_C3 -5.16770688f
+#define GEN_SIN_C5 2.55003138f
+#define GEN_SIN_C7 -0.598045184f
+#define GEN_SIN_C9 0.0772201455f
+
+/* Waveform kernels
+ *
+ * Turn a run of oscillator phases (as kept by osc_advance) into samples.
+ * Every kernel performs the same float operations as the per-sample
+ * generators, so block and per-sample output stay identical.
+ */
+struct gen_kernels {
+    const char *name;
+    void (*sin)(float *out, const uint32_t *phases, int frames);
+    void (*cos)(float *out, const uint32_t *phases, int frames);
+
+    /* Read table at every phase, interpolating linearly */
+    void (*wavetable)(float *out, const uint32_t *phases, const float *table,
+        int frames);
+
+    /* Pulses of the phases advancing from phases[0], backwards when set */
+    void (*pulse)(float *out, const uint32_t *phases, int backwards,
+        int frames);
+
+    /* Phase increments of frequencies (see _gen_increment) */
+    void (*increment)(uint32_t *increments, const float *hertz, double scale,
+        int frames);
+
+    /* Whitenoise samples first up to first + frames of the sequence of key
+     * (see _gen_noise_key) */
+    void (*noise)(float *buf, uint32_t first, uint32_t key, int frames);
+};
+
+/* Band-limited wavetables
+ *
+ * Every waveform has GEN_WT_LEVELS tables of GEN_WT_SIZE samples, plus a
+ * guard sample for interpolation. Level k holds the harmonics up to
+ * GEN_WT_HARMONICS >> k, an oscillator reads the level with the most
+ * harmonics that all stay below the Nyquist frequency. The tables are built
+ * once by gen_init and shared read-only by all oscillators.
+ */
+#define GEN_WT_BITS 11
+#define GEN_WT_SIZE (1 << GEN_WT_BITS)
+#define GEN_WT_LEVELS 10
+#define GEN_WT_HARMONICS (1 << (GEN_WT_LEVELS - 1))
+
+enum gen_wave {
+    GEN_WAVE_SAW,
+    GEN_WAVE_SQUARE,
+    GEN_WAVE_TRIANGLE,
+    GEN_WAVES,
+
+    /* Polynomial waveforms, see _gen_sin_cycle */
+    GEN_WAVE_SIN = -1,
+    GEN_WAVE_COS = -2,
+    /* 1 whenever the oscillator completes a cycle, 0 otherwise */
+    GEN_WAVE_PULSE = -3
+};
+
+static float wavetables[GEN_WAVES][GEN_WT_LEVELS][GEN_WT_SIZE + 1];
+
+/* Discontinuity of a piecewise linear waveform: at cycle, the value jumps
+ * by jump and the slope changes by slope
+ */
+struct gen_break {
+    double cycle, jump, slope;
+};
+
+/* The naive waveforms, described by their discontinuities (up to a
+ * negative cycle) */
+static struct gen_break gen_breaks[GEN_WAVES][3] = {
+    /* Sawtooth: 2 * cycle - 1 */
+    {{0.0, -2.0, 0.0}, {-1.0, 0.0, 0.0}},
+    /* Square: 1 for the first half of the cycle, -1 for the second */
+    {{0.0, 2.0, 0.0}, {0.5, -2.0, 0.0}, {-1.0, 0.0, 0.0}},
+    /* Triangle: rising from -1 to 0 and falling from 1 to 0, a quarter
+     * cycle late */
+    {{0.25, -1.0, 4.0}, {0.75, 1.0, -4.0}, {-1.0, 0.0, 0.0}}
+};
+
+/* Local function definitions */
+static uint32_t _gen_increment(float hertz, double scale);
+static float _gen_phase_cycle(uint32_t phase);
+static float _gen_sin_cycle(float cycle);
+static float _gen_cos_cycle(float cycle);
+static void _gen_build_wavetable(int wave, double *cosines, double *sines);
+static int _gen_level(uint32_t increment);
+static float *_gen_wavetable_level(int wave, uint32_t increment);
+static float _gen_wavetable_read(const float *table, uint32_t phase);
+static uint32_t _gen_hash(uint32_t x);
+static uint32_t _gen_noise_key(void **storage, int64_t samples);
+static float _gen_noise(uint32_t n);
+static float _gen_pulse(osc_local osc, uint32_t prev);
+static int _gen_run_level(int wave, uint32_t increment);
+static void _gen_render_run(float *out, const uint32_t *phases, int wave,
+    int level, int frames);
+static void _gen_advance_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames, int wave);
+
+/* Phase increment per sample of an oscillator of hertz, scale is the
+ * sample period in phase units
+ *
+ * Negative frequencies wrap to huge increments, running the phase
+ * backwards. Frequencies out of any sensible range, including infinity and
+ * NaN, stop the oscillator.
+ */
+static uint32_t _gen_increment(float hertz, double scale)
+{
+    double increment = hertz * scale;
+
+    if (!(fabs(increment) < 9e18))
+        return 0;
+    return (uint32_t)(int64_t)increment;
+}
+
+/* Convert phase to a cycle in [-0.5, 0.5] */
+static float _gen_phase_cycle(uint32_t phase)
+{
+    return (float)(int32_t)phase * GEN_PHASE_SCALE;
+}
+
 /* Convenience function for decoupled oscillators
  *
- * This functions generates a signal of
- * hertz cycles/second.
+ * This functions generates a signal of hertz cycles/second, advancing the
+ * phase by every sample since the previous call.
  */
 void osc_advance(osc_local osc, struct sampleclock sc, float hertz)
 {
-    osc->cycle = fmodf(osc->cycle + (sc.seconds - osc->prev_seconds) * hertz,
-        1.0f);
-    osc->prev_seconds = sc.seconds;
+    osc->increment = _gen_increment(hertz, sc.period * GEN_PHASE_CYCLE);
+    osc->phase += osc->increment * (uint32_t)(sc.samples - osc->prev_samples);
+    osc->prev_samples = sc.samples;
+    return;
+}
+
+/* Approximate sin(2 * pi * cycle) for cycles in (-1.5, 1.5)
+ *
+ * The cycle is reduced (exactly) to y in [-0.5, 0.5] with
+ * sin(2 * pi * cycle) = sin(pi * y), which is evaluated as an odd
+ * polynomial of degree 9 fitted for minimal absolute error. Evaluated in
+ * float, the absolute error over all float cycles in (-1, 1) is below
+ * 2.1e-7 for the sine and 4e-7 for the cosine (cycle + 0.25f rounds).
+ * Calling libm with a float argument 2 * pi * cycle was off by up to 4.2e-7.
+ */
+static float _gen_sin_cycle(float cycle)
+{
+    float y, p;
+
+    cycle -= (float)(cycle > 0.5f) - (float)(cycle < -0.5f);
+    y = cycle + cycle;
+    if (fabsf(y) > 0.5f)
+        y = (y > 0.0f ? 1.0f : -1.0f) - y;
+
+    p = y * y;
+    return y * (GEN_SIN_C1 + p * (GEN_SIN_C3 + p * (GEN_SIN_C5 +
+        p * (GEN_SIN_C7 + p * GEN_SIN_C9))));
+}
+
+/* Approximate cos(2 * pi * cycle), a quarter cycle ahead of the sine */
+static float _gen_cos_cycle(float cycle)
+{
+    return _gen_sin_cycle(cycle + 0.25f);
+}
+
+/* Build the tables of wave from the Fourier series of its naive waveform
+ *
+ * For a piecewise linear waveform, harmonic k follows from the
+ * discontinuities alone: with w = 2 * pi * k, its complex coefficient is
+ * sum(jump * e^(-i w cycle)) / (i w) + sum(slope * e^(-i w cycle)) / (i w)^2.
+ * Harmonics are summed from the lowest up, storing every level as soon as
+ * its last harmonic has been added.
+ */
+static void _gen_build_wavetable(int wave, double *cosines, double *sines)
+{
+    double *acc, w, re, im;
+    struct gen_break *b;
+    int k, n, level = GEN_WT_LEVELS - 1;
+
+    acc = calloc(GEN_WT_SIZE, sizeof(double));
+    if (!acc) {
+        perror("_gen_build_wavetable.calloc");
+        exit(1);
+    }
+
+    for (k = 1; k <= GEN_WT_HARMONICS; k++) {
+        w = 2.0 * M_PI * k;
+        re = im = 0.0;
+        for (b = gen_breaks[wave]; b->cycle >= 0.0; b++) {
+            re += -b->jump * sin(w * b->cycle) / w -
+                b->slope * cos(w * b->cycle) / (w * w);
+            im += -b->jump * cos(w * b->cycle) / w +
+                b->slope * sin(w * b->cycle) / (w * w);
+        }
+
+        /* f(cycle) += 2 * Re(c_k * e^(i w cycle)) */
+        for (n = 0; n < GEN_WT_SIZE; n++)
+            acc[n] += 2.0 * (re * cosines[(k * n) % GEN_WT_SIZE] -
+                im * sines[(k * n) % GEN_WT_SIZE]);
+
+        if (k == GEN_WT_HARMONICS >> level) {
+            for (n = 0; n < GEN_WT_SIZE; n++)
+                wavetables[wave][level][n] = (float)acc[n];
+            wavetables[wave][level][GEN_WT_SIZE] = (float)acc[0];
+            level--;
+        }
+    }
+
+    free(acc);
     return;
 }
 
-/* Setup decoupled oscillator structure if it does not exist yet */
+/* Select the table level for an oscillator advancing increment per sample
+ *
+ * A table holding H harmonics is free of aliasing if H * |increment| stays
+ * below half a cycle, 2^31. With |increment| below 2^b, the level is b - 22.
+ */
+static int _gen_level(uint32_t increment)
+{
+    int level;
+
+    if ((int32_t)increment < 0)
+        increment = -increment;
+    level = increment ? 32 - __builtin_clz(increment) -
+        (31 - (GEN_WT_LEVELS - 1)) : 0;
+
+    if (level < 0)
+        level = 0;
+    else if (level >= GEN_WT_LEVELS)
+        level = GEN_WT_LEVELS - 1;
+
+    return level;
+}
+
+/* Select the table of wave for an oscillator advancing increment per
+ * sample */
+static float *_gen_wavetable_level(int wave, uint32_t increment)
+{
+    return wavetables[wave][_gen_level(increment)];
+}
+
+/* Read table at phase, interpolating linearly */
+static float _gen_wavetable_read(const float *table, uint32_t phase)
+{
+    uint32_t i = phase >> (32 - GEN_WT_BITS);
+    float frac = (float)(int)(phase & ((1u << (32 - GEN_WT_BITS)) - 1)) *
+        (1.0f / (float)(1u << (32 - GEN_WT_BITS)));
+
+    return table[i] + frac * (table[i + 1] - table[i]);
+}
+
+/* Return 1 if the oscillator completed a cycle advancing from phase prev */
+static float _gen_pulse(osc_local osc, uint32_t prev)
+{
+    if ((int32_t)osc->increment >= 0)
+        return osc->phase < prev ? 1.0f : 0.0f;
+    return osc->phase > prev ? 1.0f : 0.0f;
+}
+
+/* Setup decoupled oscillator structure if it was not started yet
+ *
+ * Graph nodes come with their storage, it is only allocated here for
+ * oscillators used outside of a graph.
+ */
 static void _gen_setup_storage(void **storage, struct sampleclock sc)
 {
+    osc_local osc;
+
     if (!*storage) {
-        *storage = malloc(sizeof(struct _osc_local));
+        *storage = calloc(1, sizeof(struct _osc_local));
 
         if (!*storage) {
-            perror("_gen_setup_storage.malloc");
+            perror("_gen_setup_storage.calloc");
             exit(1);
         }
+    }
 
-        ((osc_local)*storage)->cycle = 0.0f;
-        ((osc_local)*storage)->prev_seconds = sc.seconds;
+    osc = *storage;
+    if (!osc->started) {
+        osc->started = 1;
+        osc->prev_samples = sc.samples;
     }
 
     return;
 }
 
+/* Return the size of the local storage of oscillators */
+size_t gen_storage_size(void)
+{
+    return sizeof(struct _osc_local);
+}
+
 #define DECOUPLED_OSC \
     osc_local osc; \
     _gen_setup_storage(storage, sc); \
@@ -63,70 +360,678 @@ static void _gen_setup_storage(void **storage, struct sampleclock sc)
 float gen_sin(struct sampleclock sc, void **storage, float hertz)
 {
     DECOUPLED_OSC
-    return sin(M_PI * 2.0f * osc->cycle);
+    return _gen_sin_cycle(_gen_phase_cycle(osc->phase));
 }
 
 /* Generate cosine wave */
 float gen_cos(struct sampleclock sc, void **storage, float hertz)
 {
     DECOUPLED_OSC
-    return cos(M_PI * 2.0f * osc->cycle);
+    return _gen_cos_cycle(_gen_phase_cycle(osc->phase));
 }
 
 /* Generate triangle wave */
 float gen_triangle(struct sampleclock sc, void **storage, float hertz)
 {
-    float cycle;
     DECOUPLED_OSC
-    cycle = osc->cycle - 0.25f;
-
-    if (cycle < 0.0f)
-        cycle += 1.0f;
-
-    if (cycle < 0.5f)
-        return -1.0f + 2.0f * cycle;
-    return 1.0f - 2.0f * (cycle - 0.5f);
+    return _gen_wavetable_read(_gen_wavetable_level(GEN_WAVE_TRIANGLE,
+        osc->increment), osc->phase);
 }
 
 /* Generate sawtooth wave (|\|\|\) */
 float gen_saw(struct sampleclock sc, void **storage, float hertz)
 {
     DECOUPLED_OSC
-    return 2.0f * osc->cycle - 1.0f;
+    return _gen_wavetable_read(_gen_wavetable_level(GEN_WAVE_SAW,
+        osc->increment), osc->phase);
 }
 
 /* Generate reverse sawtooth wave (/|/|/|) */
 float gen_rsaw(struct sampleclock sc, void **storage, float hertz)
 {
     DECOUPLED_OSC
-    return -gen_saw(sc, storage, hertz);
+    return -_gen_wavetable_read(_gen_wavetable_level(GEN_WAVE_SAW,
+        osc->increment), osc->phase);
 }
 
 /* Generate pulse wave (|....|....|....) */
 float gen_pulse(struct sampleclock sc, void **storage, float hertz)
 {
-    float speriod = (float)sc.samplerate / hertz;
-    DECOUPLED_OSC
+    uint32_t prev;
+    osc_local osc;
+
+    _gen_setup_storage(storage, sc);
+    osc = *storage;
+    prev = osc->phase;
+    osc_advance(osc, sc, hertz);
 
-    return (fmodf((float)sc.samples, speriod) <
-        fmodf((float)(sc.samples + 1), speriod)) ?
-        0.0f : 1.0f;
+    return _gen_pulse(osc, prev);
 }
 
 /* Generate square wave */
 float gen_square(struct sampleclock sc, void **storage, float hertz)
 {
     DECOUPLED_OSC
-    return osc->cycle < 0.5f ? 1.0f : -1.0f;
+    return _gen_wavetable_read(_gen_wavetable_level(GEN_WAVE_SQUARE,
+        osc->increment), osc->phase);
+}
+
+/* Mix the bits of x (the lowbias32 integer hash) */
+static uint32_t _gen_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+
+    return x;
+}
+
+/* Return noise sample n of a sequence, hashed with its key */
+static float _gen_noise(uint32_t n)
+{
+    return (int32_t)_gen_hash(n) * GEN_NOISE_SCALE;
+}
+
+/* Return the key of a noise sequence, for the 2^32 samples sharing the
+ * high half of samples. Noise sample n is the hash of n ^ key.
+ */
+static uint32_t _gen_noise_key(void **storage, int64_t samples)
+{
+    uint32_t seed = *storage ? ((noise_local)*storage)->seed : 0;
+
+    return seed ^ _gen_hash((uint32_t)((uint64_t)samples >> 32));
 }
 
-/* Generate whitenoise (sort of) */
+/* Seed the storage of a new whitenoise node */
+void gen_noise_init(void *storage)
+{
+    ((noise_local)storage)->seed = _gen_hash(++noise_seeds);
+
+    return;
+}
+
+/* Return the size of the local storage of whitenoise */
+size_t gen_noise_storage_size(void)
+{
+    return sizeof(struct _noise_local);
+}
+
+/* Generate whitenoise */
 float gen_whitenoise(struct sampleclock sc, void **storage)
 {
-    /*
-    if (sc.samples % sc.samplerate == 0)
-        printf("%f\n", drand48());
-    */
-    return (float)((double)random() / (double)RAND_MAX * 2.0 - 1.0);
+    return _gen_noise((uint32_t)sc.samples ^
+        _gen_noise_key(storage, sc.samples));
+}
+
+
+/* -------- Block generation -------- */
+
+#if defined(__x86_64__)
+
+/* Vector waveform kernel, mapping WIDTH phases at a time to cycles with
+ * LOAD and through VFUNC, and the remainder of the run through the scalar
+ * FUNC
+ */
+#define GEN_KERNEL_VECTOR(NAME, ATTR, WIDTH, LOAD, STORE, VFUNC, FUNC) \
+ATTR void NAME(float *out, const uint32_t *phases, int frames) \
+{ \
+    int i; \
+    for (i = 0; i + WIDTH <= frames; i += WIDTH) \
+        STORE(out + i, VFUNC(LOAD(phases + i))); \
+    for (; i < frames; i++) \
+        out[i] = FUNC(_gen_phase_cycle(phases[i])); \
+}
+
+/* SSE2, part of every x86-64 CPU: 4 samples per instruction */
+#define GEN_SSE2(NAME, VFUNC, FUNC) GEN_KERNEL_VECTOR(NAME, static, 4, \
+    _gen_cycle_sse2, _mm_storeu_ps, VFUNC, FUNC)
+
+/* See _gen_phase_cycle */
+static __m128 _gen_cycle_sse2(const uint32_t *phases)
+{
+    return _mm_mul_ps(
+        _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)phases)),
+        _mm_set1_ps(GEN_PHASE_SCALE));
+}
+
+/* Select a where mask is set, b elsewhere */
+static __m128 _gen_select_sse2(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/* See _gen_sin_cycle */
+static __m128 _gen_sin_sse2(__m128 cycle)
+{
+    const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f),
+        sign = _mm_set1_ps(-0.0f);
+    __m128 y, q, p;
+
+    cycle = _mm_sub_ps(cycle, _mm_sub_ps(
+        _mm_and_ps(_mm_cmpgt_ps(cycle, half), one),
+        _mm_and_ps(_mm_cmplt_ps(cycle, _mm_set1_ps(-0.5f)), one)));
+    y = _mm_add_ps(cycle, cycle);
+    y = _gen_select_sse2(_mm_cmpgt_ps(_mm_andnot_ps(sign, y), half),
+        _mm_sub_ps(_mm_or_ps(_mm_and_ps(sign, y), one), y), y);
+
+    q = _mm_mul_ps(y, y);
+    p = _mm_add_ps(_mm_set1_ps(GEN_SIN_C7),
+        _mm_mul_ps(q, _mm_set1_ps(GEN_SIN_C9)));
+    p = _mm_add_ps(_mm_set1_ps(GEN_SIN_C5), _mm_mul_ps(q, p));
+    p = _mm_add_ps(_mm_set1_ps(GEN_SIN_C3), _mm_mul_ps(q, p));
+    p = _mm_add_ps(_mm_set1_ps(GEN_SIN_C1), _mm_mul_ps(q, p));
+    return _mm_mul_ps(y, p);
 }
 
+static __m128 _gen_cos_sse2(__m128 cycle)
+{
+    return _gen_sin_sse2(_mm_add_ps(cycle, _mm_set1_ps(0.25f)));
+}
+
+GEN_SSE2(_gen_sin_sse2_block, _gen_sin_sse2, _gen_sin_cycle)
+GEN_SSE2(_gen_cos_sse2_block, _gen_cos_sse2, _gen_cos_cycle)
+
+/* Wavetable kernel, 4 samples at a time: the table index and fraction are
+ * taken from the phases in vector registers, the pair of table samples
+ * around every phase is loaded at once and transposed for the lerp (see
+ * _gen_wavetable_read)
+ */
+#define GEN_WAVETABLE_VECTOR(NAME, ATTR) \
+ATTR void NAME(float *out, const uint32_t *phases, const float *table, \
+    int frames) \
+{ \
+    const __m128i mask = _mm_set1_epi32((1 << (32 - GEN_WT_BITS)) - 1); \
+    const __m128 zero = _mm_setzero_ps(), \
+        scale = _mm_set1_ps(1.0f / (float)(1u << (32 - GEN_WT_BITS))); \
+    __m128i phase; \
+    __m128 frac, p0, p1, p2, p3, a, b; \
+    int i, index[4]; \
+    for (i = 0; i + 4 <= frames; i += 4) { \
+        phase = _mm_loadu_si128((const __m128i *)(phases + i)); \
+        _mm_storeu_si128((__m128i *)index, \
+            _mm_srli_epi32(phase, 32 - GEN_WT_BITS)); \
+        frac = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(phase, mask)), \
+            scale); \
+        p0 = _mm_loadl_pi(zero, (const __m64 *)(table + index[0])); \
+        p1 = _mm_loadl_pi(zero, (const __m64 *)(table + index[1])); \
+        p2 = _mm_loadl_pi(zero, (const __m64 *)(table + index[2])); \
+        p3 = _mm_loadl_pi(zero, (const __m64 *)(table + index[3])); \
+        p0 = _mm_unpacklo_ps(p0, p1); \
+        p2 = _mm_unpacklo_ps(p2, p3); \
+        a = _mm_movelh_ps(p0, p2); \
+        b = _mm_movehl_ps(p2, p0); \
+        _mm_storeu_ps(out + i, \
+            _mm_add_ps(a, _mm_mul_ps(frac, _mm_sub_ps(b, a)))); \
+    } \
+    for (; i < frames; i++) \
+        out[i] = _gen_wavetable_read(table, phases[i]); \
+}
+
+/* Pulse kernel, 4 samples at a time: a pulse is an unsigned carry of the
+ * phase, compared signed with the sign bits flipped (see _gen_pulse)
+ */
+#define GEN_PULSE_VECTOR(NAME, ATTR) \
+ATTR void NAME(float *out, const uint32_t *phases, int backwards, \
+    int frames) \
+{ \
+    const __m128i flip = _mm_set1_epi32((int)0x80000000U); \
+    const __m128 one = _mm_set1_ps(1.0f); \
+    __m128i prev, phase; \
+    int i; \
+    for (i = 0; i + 4 <= frames; i += 4) { \
+        prev = _mm_xor_si128(flip, \
+            _mm_loadu_si128((const __m128i *)(phases + i))); \
+        phase = _mm_xor_si128(flip, \
+            _mm_loadu_si128((const __m128i *)(phases + i + 1))); \
+        _mm_storeu_ps(out + i, _mm_and_ps(one, _mm_castsi128_ps(backwards ? \
+            _mm_cmpgt_epi32(phase, prev) : _mm_cmplt_epi32(phase, prev)))); \
+    } \
+    for (; i < frames; i++) \
+        out[i] = (backwards ? phases[i + 1] > phases[i] : \
+            phases[i + 1] < phases[i]) ? 1.0f : 0.0f; \
+}
+
+GEN_WAVETABLE_VECTOR(_gen_wavetable_sse2_block, static)
+GEN_PULSE_VECTOR(_gen_pulse_sse2_block, static)
+
+/* Increment kernel, 4 frequencies at a time: truncating to 32 bits is exact
+ * when every increment is below half a cycle, frequencies above Nyquist go
+ * through _gen_increment
+ */
+static void _gen_increment_sse2_block(uint32_t *increments, const float *hertz,
+    double scale, int frames)
+{
+    const __m128d s = _mm_set1_pd(scale), limit = _mm_set1_pd(2147483648.0),
+        sign = _mm_set1_pd(-0.0);
+    __m128d lo, hi;
+    __m128 h;
+    int i, j;
+
+    for (i = 0; i + 4 <= frames; i += 4) {
+        h = _mm_loadu_ps(hertz + i);
+        lo = _mm_mul_pd(_mm_cvtps_pd(h), s);
+        hi = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(h, h)), s);
+        if ((_mm_movemask_pd(_mm_cmplt_pd(_mm_andnot_pd(sign, lo), limit)) &
+                _mm_movemask_pd(_mm_cmplt_pd(_mm_andnot_pd(sign, hi),
+                    limit))) != 3) {
+            for (j = i; j < i + 4; j++)
+                increments[j] = _gen_increment(hertz[j], scale);
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)(increments + i), _mm_unpacklo_epi64(
+            _mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi)));
+    }
+    for (; i < frames; i++)
+        increments[i] = _gen_increment(hertz[i], scale);
+}
+
+/* Noise kernel, hashing 4 samples at a time with MULLO multiplying 32 bit
+ * lanes (see _gen_hash), and the remainder of the block one at a time
+ */
+#define GEN_NOISE_VECTOR(NAME, ATTR, MULLO) \
+ATTR void NAME(float *buf, uint32_t first, uint32_t key, int frames) \
+{ \
+    const __m128i k = _mm_set1_epi32(key), four = _mm_set1_epi32(4), \
+        m1 = _mm_set1_epi32(0x7feb352d), m2 = _mm_set1_epi32((int)0x846ca68bU); \
+    const __m128 scale = _mm_set1_ps(GEN_NOISE_SCALE); \
+    __m128i n = _mm_add_epi32(_mm_set1_epi32(first), \
+        _mm_set_epi32(3, 2, 1, 0)), x; \
+    int i; \
+    for (i = 0; i + 4 <= frames; i += 4) { \
+        x = _mm_xor_si128(n, k); \
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 16)); \
+        x = MULLO(x, m1); \
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 15)); \
+        x = MULLO(x, m2); \
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 16)); \
+        _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale)); \
+        n = _mm_add_epi32(n, four); \
+    } \
+    for (; i < frames; i++) \
+        buf[i] = _gen_noise((first + i) ^ key); \
+}
+
+/* Multiply 32 bit lanes keeping the low halves, pmulld is SSE4.1 */
+static __m128i _gen_mullo_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b),
+        odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(
+        _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+GEN_NOISE_VECTOR(_gen_noise_sse2_block, static, _gen_mullo_sse2)
+
+static struct gen_kernels gen_sse2 = {
+    "sse2",
+    _gen_sin_sse2_block, _gen_cos_sse2_block,
+    _gen_wavetable_sse2_block, _gen_pulse_sse2_block,
+    _gen_increment_sse2_block,
+    _gen_noise_sse2_block
+};
+
+/* AVX: 8 samples per instruction, compiled for AVX without enabling it for
+ * the rest of the file. No FMA, so results match the other kernels.
+ */
+#define GEN_AVX __attribute__((target("avx")))
+#define GEN_AVX_KERNEL(NAME, VFUNC, FUNC) GEN_KERNEL_VECTOR(NAME, GEN_AVX static, \
+    8, _gen_cycle_avx, _mm256_storeu_ps, VFUNC, FUNC)
+
+GEN_AVX static __m256 _gen_cycle_avx(const uint32_t *phases)
+{
+    return _mm256_mul_ps(
+        _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)phases)),
+        _mm256_set1_ps(GEN_PHASE_SCALE));
+}
+
+GEN_AVX static __m256 _gen_select_avx(__m256 mask, __m256 a, __m256 b)
+{
+    return _mm256_blendv_ps(b, a, mask);
+}
+
+GEN_AVX static __m256 _gen_sin_avx(__m256 cycle)
+{
+    const __m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f),
+        sign = _mm256_set1_ps(-0.0f);
+    __m256 y, q, p;
+
+    cycle = _mm256_sub_ps(cycle, _mm256_sub_ps(
+        _mm256_and_ps(_mm256_cmp_ps(cycle, half, _CMP_GT_OQ), one),
+        _mm256_and_ps(_mm256_cmp_ps(cycle, _mm256_set1_ps(-0.5f),
+            _CMP_LT_OQ), one)));
+    y = _mm256_add_ps(cycle, cycle);
+    y = _gen_select_avx(
+        _mm256_cmp_ps(_mm256_andnot_ps(sign, y), half, _CMP_GT_OQ),
+        _mm256_sub_ps(_mm256_or_ps(_mm256_and_ps(sign, y), one), y), y);
+
+    q = _mm256_mul_ps(y, y);
+    p = _mm256_add_ps(_mm256_set1_ps(GEN_SIN_C7),
+        _mm256_mul_ps(q, _mm256_set1_ps(GEN_SIN_C9)));
+    p = _mm256_add_ps(_mm256_set1_ps(GEN_SIN_C5), _mm256_mul_ps(q, p));
+    p = _mm256_add_ps(_mm256_set1_ps(GEN_SIN_C3), _mm256_mul_ps(q, p));
+    p = _mm256_add_ps(_mm256_set1_ps(GEN_SIN_C1), _mm256_mul_ps(q, p));
+    return _mm256_mul_ps(y, p);
+}
+
+GEN_AVX static __m256 _gen_cos_avx(__m256 cycle)
+{
+    return _gen_sin_avx(_mm256_add_ps(cycle, _mm256_set1_ps(0.25f)));
+}
+
+GEN_AVX_KERNEL(_gen_sin_avx_block, _gen_sin_avx, _gen_sin_cycle)
+GEN_AVX_KERNEL(_gen_cos_avx_block, _gen_cos_avx, _gen_cos_cycle)
+
+/* AVX has no 8 lane integer instructions, but includes pmulld. Tables and
+ * pulses are integer work as well, they only gain the VEX encoding.
+ */
+GEN_NOISE_VECTOR(_gen_noise_avx_block, GEN_AVX static, _mm_mullo_epi32)
+GEN_WAVETABLE_VECTOR(_gen_wavetable_avx_block, GEN_AVX static)
+GEN_PULSE_VECTOR(_gen_pulse_avx_block, GEN_AVX static)
+
+/* See _gen_increment_sse2_block, converting 4 frequencies to double at once */
+GEN_AVX static void _gen_increment_avx_block(uint32_t *increments,
+    const float *hertz, double scale, int frames)
+{
+    const __m256d s = _mm256_set1_pd(scale),
+        limit = _mm256_set1_pd(2147483648.0), sign = _mm256_set1_pd(-0.0);
+    __m256d x;
+    int i, j;
+
+    for (i = 0; i + 4 <= frames; i += 4) {
+        x = _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(hertz + i)), s);
+        if (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(sign, x), limit,
+                _CMP_LT_OQ)) != 15) {
+            for (j = i; j < i + 4; j++)
+                increments[j] = _gen_increment(hertz[j], scale);
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)(increments + i), _mm256_cvttpd_epi32(x));
+    }
+    for (; i < frames; i++)
+        increments[i] = _gen_increment(hertz[i], scale);
+}
+
+static struct gen_kernels gen_avx = {
+    "avx",
+    _gen_sin_avx_block, _gen_cos_avx_block,
+    _gen_wavetable_avx_block, _gen_pulse_avx_block,
+    _gen_increment_avx_block,
+    _gen_noise_avx_block
+};
+
+/* Kernels in use, upgraded by gen_init */
+static struct gen_kernels *kernels = &gen_sse2;
+
+#else
+
+/* Scalar waveform kernel, mapping the cycle of every phase through FUNC */
+#define GEN_KERNEL_SCALAR(NAME, FUNC) \
+static void NAME(float *out, const uint32_t *phases, int frames) \
+{ \
+    int i; \
+    for (i = 0; i < frames; i++) \
+        out[i] = FUNC(_gen_phase_cycle(phases[i])); \
+}
+
+GEN_KERNEL_SCALAR(_gen_sin_scalar, _gen_sin_cycle)
+GEN_KERNEL_SCALAR(_gen_cos_scalar, _gen_cos_cycle)
+
+static void _gen_wavetable_scalar(float *out, const uint32_t *phases,
+    const float *table, int frames)
+{
+    int i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = _gen_wavetable_read(table, phases[i]);
+}
+
+static void _gen_pulse_scalar(float *out, const uint32_t *phases,
+    int backwards, int frames)
+{
+    int i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = (backwards ? phases[i + 1] > phases[i] :
+            phases[i + 1] < phases[i]) ? 1.0f : 0.0f;
+}
+
+static void _gen_noise_scalar(float *buf, uint32_t first, uint32_t key,
+    int frames)
+{
+    int i;
+
+    for (i = 0; i < frames; i++)
+        buf[i] = _gen_noise((first + i) ^ key);
+}
+
+static void _gen_increment_scalar(uint32_t *increments, const float *hertz,
+    double scale, int frames)
+{
+    int i;
+
+    for (i = 0; i < frames; i++)
+        increments[i] = _gen_increment(hertz[i], scale);
+}
+
+static struct gen_kernels gen_scalar = {
+    "scalar",
+    _gen_sin_scalar, _gen_cos_scalar,
+    _gen_wavetable_scalar, _gen_pulse_scalar,
+    _gen_increment_scalar,
+    _gen_noise_scalar
+};
+
+static struct gen_kernels *kernels = &gen_scalar;
+
+#endif
+
+/* Build the wavetables and select the fastest waveform kernels supported
+ * by this CPU
+ *
+ * Must be called before any oscillator runs, and before any block is
+ * generated on another thread.
+ */
+void gen_init(void)
+{
+    static int initialized = 0;
+    double cosines[GEN_WT_SIZE], sines[GEN_WT_SIZE];
+    int n, wave;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        kernels = &gen_avx;
+#endif
+
+    if (initialized)
+        return;
+    initialized = 1;
+
+    for (n = 0; n < GEN_WT_SIZE; n++) {
+        cosines[n] = cos(2.0 * M_PI * n / GEN_WT_SIZE);
+        sines[n] = sin(2.0 * M_PI * n / GEN_WT_SIZE);
+    }
+
+    for (wave = 0; wave < GEN_WAVES; wave++)
+        _gen_build_wavetable(wave, cosines, sines);
+
+    return;
+}
+
+/* Return the amount of memory used by the shared wavetables */
+size_t gen_wavetables_size(void)
+{
+    return sizeof(wavetables);
+}
+
+/* Return the name of the waveform kernels in use */
+const char *gen_kernels_name(void)
+{
+    return kernels->name;
+}
+
+/* Return what a run of frames advancing increment per sample of wave
+ * shares: the table level of a wavetable, or whether the phase of a pulse
+ * runs backwards
+ */
+static int _gen_run_level(int wave, uint32_t increment)
+{
+    if (wave >= 0)
+        return _gen_level(increment);
+    if (wave == GEN_WAVE_PULSE)
+        return (int32_t)increment < 0;
+    return 0;
+}
+
+/* Render a run of frames of wave through its kernel, phases[0] being the
+ * phase before the first frame
+ */
+static void _gen_render_run(float *out, const uint32_t *phases, int wave,
+    int level, int frames)
+{
+    switch (wave) {
+        case GEN_WAVE_SIN:
+            kernels->sin(out, phases + 1, frames);
+            break;
+
+        case GEN_WAVE_COS:
+            kernels->cos(out, phases + 1, frames);
+            break;
+
+        case GEN_WAVE_PULSE:
+            kernels->pulse(out, phases, level, frames);
+            break;
+
+        default:
+            kernels->wavetable(out, phases + 1, wavetables[wave][level],
+                frames);
+    }
+
+    return;
+}
+
+/* Generate a block of wave from a decoupled oscillator
+ *
+ * Increments and phases are computed GEN_CHUNK frames at a time, performing
+ * the same operations as osc_advance for every frame. The run level only
+ * grows with the size of the increment, so a chunk whose smallest and
+ * largest increments share a level goes through the waveform kernels at
+ * once, a chunk crossing levels is split into runs. Block output is
+ * identical to per-sample output. out may be hertz, the frequencies of a
+ * chunk are read before any of its frames is rendered.
+ */
+static void _gen_advance_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames, int wave)
+{
+    uint32_t phases[GEN_CHUNK + 1], increments[GEN_CHUNK], phase;
+    int32_t lowest, highest;
+    osc_local osc;
+    double scale = sc.period * GEN_PHASE_CYCLE;
+    int c, i, n, start, level, next;
+
+    _gen_setup_storage(storage, sc);
+    osc = *storage;
+    if (frames < 1)
+        return;
+
+    phase = phases[0] = osc->phase;
+    for (c = 0; c < frames; c += n) {
+        n = frames - c < GEN_CHUNK ? frames - c : GEN_CHUNK;
+        kernels->increment(increments, hertz + c, scale, n);
+
+        /* The first frame catches up with every sample since the previous
+         * advance, all others advance a single sample */
+        if (!c)
+            phase += increments[0] *
+                (uint32_t)(sc.samples - osc->prev_samples - 1);
+
+        lowest = highest = (int32_t)increments[0];
+        for (i = 0; i < n; i++) {
+            phase += increments[i];
+            phases[i + 1] = phase;
+            if ((int32_t)increments[i] < lowest)
+                lowest = (int32_t)increments[i];
+            if ((int32_t)increments[i] > highest)
+                highest = (int32_t)increments[i];
+        }
+
+        level = _gen_run_level(wave, lowest);
+        if ((lowest < 0) == (highest < 0) &&
+                level == _gen_run_level(wave, highest)) {
+            _gen_render_run(out + c, phases, wave, level, n);
+        } else {
+            level = _gen_run_level(wave, increments[0]);
+            for (start = 0, i = 1; i < n; i++) {
+                next = _gen_run_level(wave, increments[i]);
+                if (next != level) {
+                    _gen_render_run(out + c + start, phases + start, wave,
+                        level, i - start);
+                    start = i;
+                    level = next;
+                }
+            }
+            _gen_render_run(out + c + start, phases + start, wave, level,
+                n - start);
+        }
+
+        phases[0] = phase;
+    }
+
+    osc->phase = phase;
+    osc->increment = increments[n - 1];
+    osc->prev_samples = sc.samples + frames - 1;
+
+    return;
+}
+
+/* Generate a block of a decoupled oscillator through its waveform kernel */
+#define GEN_KERNEL_BLOCK(NAME, WAVE) \
+void NAME ## _block(struct sampleclock sc, void **storage, \
+    float *out, float *hertz, int frames) \
+{ \
+    _gen_advance_block(sc, storage, out, hertz, frames, WAVE); \
+}
+
+GEN_KERNEL_BLOCK(gen_sin, GEN_WAVE_SIN)
+GEN_KERNEL_BLOCK(gen_cos, GEN_WAVE_COS)
+GEN_KERNEL_BLOCK(gen_triangle, GEN_WAVE_TRIANGLE)
+GEN_KERNEL_BLOCK(gen_saw, GEN_WAVE_SAW)
+GEN_KERNEL_BLOCK(gen_square, GEN_WAVE_SQUARE)
+GEN_KERNEL_BLOCK(gen_pulse, GEN_WAVE_PULSE)
+
+/* Generate a block of reverse sawtooth, the negated sawtooth */
+void gen_rsaw_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames)
+{
+    int i;
+
+    _gen_advance_block(sc, storage, out, hertz, frames, GEN_WAVE_SAW);
+    for (i = 0; i < frames; i++)
+        out[i] = -out[i];
+
+    return;
+}
+
+/* Generate a block of whitenoise */
+void gen_whitenoise_block(struct sampleclock sc, void **storage,
+    float *out, int frames)
+{
+    uint32_t key = _gen_noise_key(storage, sc.samples);
+    uint32_t first = (uint32_t)sc.samples;
+    int i;
+
+    /* The key changes within the block, once every 2^32 samples */
+    if ((uint32_t)(first + frames - 1) < first) {
+        for (i = 0; i < frames; i++)
+            out[i] = gen_whitenoise(sc_advance(sc, i), storage);
+        return;
+    }
+
+    kernels->noise(out, first, key, frames);
+
+    return;
+}
@@ -1,4 +1,3 @@
-
 /* Basic waveform generation */
 float gen_sin(struct sampleclock sc, void **storage, float hertz);
 float gen_cos(struct sampleclock sc, void **storage, float hertz);
@@ -9,3 +8,30 @@ float gen_pulse(struct sampleclock sc, void **storage, float hertz);
 float gen_square(struct sampleclock sc, void **storage, float hertz);
 float gen_whitenoise(struct sampleclock sc, void **storage);
 
+/* Block waveform generation */
+void gen_sin_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_cos_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_triangle_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_saw_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_rsaw_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_pulse_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_square_block(struct sampleclock sc, void **storage,
+    float *out, float *hertz, int frames);
+void gen_whitenoise_block(struct sampleclock sc, void **storage,
+    float *out, int frames);
+
+/* Wavetables and waveform kernel selection */
+void gen_init(void);
+const char *gen_kernels_name(void);
+size_t gen_wavetables_size(void);
+
+/* Local storage of oscillators and whitenoise */
+size_t gen_storage_size(void);
+size_t gen_noise_storage_size(void);
+void gen_noise_init(void *storage);
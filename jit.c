@@ -0,0 +1,311 @@
+/* microsynth - Native code generation
+ *
+ * Translates the block part of an instruction tape into x86-64 machine code.
+ * Constants, variable reads/stores and basic arithmetic are emitted as
+ * inline SSE loops processing 4 samples per instruction. Everything else is
+ * handed back to the tape interpreter one instruction at a time, so any tape
+ * can be compiled.
+ *
+ * Slot buffers are MSYNTH_BLOCK floats, since MSYNTH_BLOCK is a multiple of
+ * 4 the loops can safely round the amount of frames up to a multiple of 4.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "sampleclock.h"
+#include "synth.h"
+#include "soundscript.h"
+#include "tape.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+/* Code buffer */
+struct jit_buf {
+    unsigned char *code;
+    size_t size, pos;
+};
+
+/* Worst case amount of bytes emitted for a single instruction */
+#define JIT_MAX_OP 96
+
+/* Local function definitions */
+static void _jit_op(struct jit_ctx *ctx, struct tape_op *op);
+static void _jit_emit(struct jit_buf *j, int n, ...);
+static void _jit_u32(struct jit_buf *j, unsigned int v);
+static void _jit_u64(struct jit_buf *j, unsigned long long v);
+static void _jit_slot(struct jit_buf *j, int op, int reg, int slot);
+static void _jit_loop_begin(struct jit_buf *j);
+static void _jit_loop_end(struct jit_buf *j, size_t top);
+static void _jit_compile_op(struct jit_buf *j, struct tape_op *op);
+
+/* Interpreter fallback, called from native code */
+static void _jit_op(struct jit_ctx *ctx, struct tape_op *op)
+{
+    tape_exec(op, op + 1, ctx->scratch, ctx->sc, 0, ctx->frames);
+    return;
+}
+
+/* Emit n bytes */
+static void _jit_emit(struct jit_buf *j, int n, ...)
+{
+    va_list ap;
+
+    va_start(ap, n);
+    while (n--)
+        j->code[j->pos++] = (unsigned char)va_arg(ap, int);
+    va_end(ap);
+
+    return;
+}
+
+/* Emit 32-bit immediate */
+static void _jit_u32(struct jit_buf *j, unsigned int v)
+{
+    memcpy(j->code + j->pos, &v, 4);
+    j->pos += 4;
+    return;
+}
+
+/* Emit 64-bit immediate */
+static void _jit_u64(struct jit_buf *j, unsigned long long v)
+{
+    memcpy(j->code + j->pos, &v, 8);
+    j->pos += 8;
+    return;
+}
+
+/* Emit SSE instruction 'op' between xmm 'reg' and [r12 + rcx + slot] */
+static void _jit_slot(struct jit_buf *j, int op, int reg, int slot)
+{
+    /* REX.B r12, 0F op, ModRM disp32 + SIB, SIB rcx + r12 */
+    _jit_emit(j, 5, 0x41, 0x0f, op, 0x84 | (reg << 3), 0x0c);
+    _jit_u32(j, slot * MSYNTH_BLOCK * sizeof(float));
+    return;
+}
+
+/* Start loop over all frames, rcx counts bytes */
+static void _jit_loop_begin(struct jit_buf *j)
+{
+    /* xor ecx, ecx */
+    _jit_emit(j, 2, 0x31, 0xc9);
+    return;
+}
+
+/* Close loop started at top */
+static void _jit_loop_end(struct jit_buf *j, size_t top)
+{
+    /* add rcx, 16; cmp rcx, r14; jb top */
+    _jit_emit(j, 4, 0x48, 0x83, 0xc1, 0x10);
+    _jit_emit(j, 3, 0x4c, 0x39, 0xf1);
+    _jit_emit(j, 2, 0x72, (int)(top - (j->pos + 2)) & 0xff);
+    return;
+}
+
+/* Compile a single tape instruction */
+static void _jit_compile_op(struct jit_buf *j, struct tape_op *op)
+{
+    union { float f; unsigned int u; } c;
+    size_t top;
+
+    switch (op->op) {
+        case TOP_CONSTANT:
+            /* mov eax, imm32; movd xmm0, eax; shufps xmm0, xmm0, 0 */
+            c.f = op->data.constant;
+            _jit_emit(j, 1, 0xb8);
+            _jit_u32(j, c.u);
+            _jit_emit(j, 4, 0x66, 0x0f, 0x6e, 0xc0);
+            _jit_emit(j, 4, 0x0f, 0xc6, 0xc0, 0x00);
+
+            _jit_loop_begin(j);
+            top = j->pos;
+            _jit_slot(j, 0x11, 0, op->dst);
+            _jit_loop_end(j, top);
+            break;
+
+        case TOP_VARIABLE:
+            /* mov rax, &var->block; mov rax, [rax] */
+            _jit_emit(j, 2, 0x48, 0xb8);
+            _jit_u64(j, (unsigned long long)(size_t)&op->data.var->block);
+            _jit_emit(j, 3, 0x48, 0x8b, 0x00);
+
+            /* movups xmm0, [rax + rcx]; movups dst, xmm0 */
+            _jit_loop_begin(j);
+            top = j->pos;
+            _jit_emit(j, 4, 0x0f, 0x10, 0x04, 0x08);
+            _jit_slot(j, 0x11, 0, op->dst);
+            _jit_loop_end(j, top);
+            break;
+
+        case TOP_ADD:
+        case TOP_SUB:
+        case TOP_MUL:
+        case TOP_DIV:
+            _jit_loop_begin(j);
+            top = j->pos;
+            _jit_slot(j, 0x10, 0, op->a);
+            _jit_slot(j, 0x10, 1, op->b);
+
+            if (op->op == TOP_ADD)
+                _jit_emit(j, 3, 0x0f, 0x58, 0xc1);
+            else if (op->op == TOP_SUB)
+                _jit_emit(j, 3, 0x0f, 0x5c, 0xc1);
+            else if (op->op == TOP_MUL)
+                _jit_emit(j, 3, 0x0f, 0x59, 0xc1);
+            else {
+                /* Division by 0 yields 0, mask out those lanes:
+                 * movaps xmm2, xmm1; xorps xmm3, xmm3;
+                 * cmpneqps xmm2, xmm3; divps xmm0, xmm1; andps xmm0, xmm2
+                 */
+                _jit_emit(j, 3, 0x0f, 0x28, 0xd1);
+                _jit_emit(j, 3, 0x0f, 0x57, 0xdb);
+                _jit_emit(j, 4, 0x0f, 0xc2, 0xd3, 0x04);
+                _jit_emit(j, 3, 0x0f, 0x5e, 0xc1);
+                _jit_emit(j, 3, 0x0f, 0x54, 0xc2);
+            }
+
+            _jit_slot(j, 0x11, 0, op->dst);
+            _jit_loop_end(j, top);
+            break;
+
+        case TOP_STORE:
+            /* mov rax, &var->block; mov rax, [rax] */
+            _jit_emit(j, 2, 0x48, 0xb8);
+            _jit_u64(j, (unsigned long long)(size_t)&op->data.var->block);
+            _jit_emit(j, 3, 0x48, 0x8b, 0x00);
+
+            /* movups xmm0, a; movups [rax + rcx], xmm0 */
+            _jit_loop_begin(j);
+            top = j->pos;
+            _jit_slot(j, 0x10, 0, op->a);
+            _jit_emit(j, 4, 0x0f, 0x11, 0x04, 0x08);
+            _jit_loop_end(j, top);
+
+            /* movss xmm0, [r12 + r13 + a - 4] (last frame) */
+            _jit_emit(j, 6, 0xf3, 0x43, 0x0f, 0x10, 0x84, 0x2c);
+            _jit_u32(j, op->a * MSYNTH_BLOCK * sizeof(float) - 4);
+
+            /* mov rax, &var->last_eval; movss [rax], xmm0 */
+            _jit_emit(j, 2, 0x48, 0xb8);
+            _jit_u64(j, (unsigned long long)(size_t)&op->data.var->last_eval);
+            _jit_emit(j, 4, 0xf3, 0x0f, 0x11, 0x00);
+            break;
+
+        default:
+            /* mov rdi, rbx; mov rsi, op; mov rax, _jit_op; call rax */
+            _jit_emit(j, 3, 0x48, 0x89, 0xdf);
+            _jit_emit(j, 2, 0x48, 0xbe);
+            _jit_u64(j, (unsigned long long)(size_t)op);
+            _jit_emit(j, 2, 0x48, 0xb8);
+            _jit_u64(j, (unsigned long long)(size_t)_jit_op);
+            _jit_emit(j, 2, 0xff, 0xd0);
+    }
+
+    assert(j->pos <= j->size);
+    return;
+}
+
+/* Native code is available on this platform */
+int jit_supported(void)
+{
+    return 1;
+}
+
+/* Compile tape instructions into a native function
+ *
+ * Returns NULL when no executable memory could be obtained.
+ */
+jit_code jit_compile(struct tape_op *ops, int size)
+{
+    struct jit_buf j;
+    jit_code code;
+    int i;
+    union {
+        void *mem;
+        jit_func func;
+    } entry;
+
+    j.pos = 0;
+    j.size = (size_t)(size + 1) * JIT_MAX_OP;
+    j.code = mmap(NULL, j.size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j.code == MAP_FAILED) {
+        perror("jit_compile.mmap");
+        return NULL;
+    }
+
+    /* Prologue:
+     * push rbx; push r12; push r13; push r14; sub rsp, 8
+     * mov rbx, rdi                     ; context
+     * mov r12, [rbx + scratch]         ; slot buffers
+     * mov r13d, [rbx + frames]; shl r13, 2
+     * lea r14, [r13 + 15]; and r14, -16 ; loop bound
+     */
+    _jit_emit(&j, 7, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56);
+    _jit_emit(&j, 4, 0x48, 0x83, 0xec, 0x08);
+    _jit_emit(&j, 3, 0x48, 0x89, 0xfb);
+    _jit_emit(&j, 4, 0x4c, 0x8b, 0x63, offsetof(struct jit_ctx, scratch));
+    _jit_emit(&j, 4, 0x44, 0x8b, 0x6b, offsetof(struct jit_ctx, frames));
+    _jit_emit(&j, 4, 0x49, 0xc1, 0xe5, 0x02);
+    _jit_emit(&j, 4, 0x4d, 0x8d, 0x75, 0x0f);
+    _jit_emit(&j, 4, 0x49, 0x83, 0xe6, 0xf0);
+
+    for (i = 0; i < size; i++)
+        _jit_compile_op(&j, ops + i);
+
+    /* Epilogue: add rsp, 8; pop r14; pop r13; pop r12; pop rbx; ret */
+    _jit_emit(&j, 4, 0x48, 0x83, 0xc4, 0x08);
+    _jit_emit(&j, 8, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+
+    /* Code may no longer be written */
+    if (mprotect(j.code, j.size, PROT_READ | PROT_EXEC)) {
+        perror("jit_compile.mprotect");
+        munmap(j.code, j.size);
+        return NULL;
+    }
+
+    code = malloc(sizeof(struct _jit_code));
+    assert(code);
+    code->mem = entry.mem = j.code;
+    code->size = j.size;
+    code->func = entry.func;
+
+    return code;
+}
+
+/* Release compiled code */
+void jit_free(jit_code code)
+{
+    if (!code)
+        return;
+
+    munmap(code->mem, code->size);
+    free(code);
+    return;
+}
+
+#else
+
+/* Native code generation is only implemented for x86-64 */
+int jit_supported(void)
+{
+    return 0;
+}
+
+jit_code jit_compile(struct tape_op *ops, int size)
+{
+    return NULL;
+}
+
+void jit_free(jit_code code)
+{
+    return;
+}
+
+#endif
@@ -0,0 +1,22 @@
+/* Native code generation for instruction tapes */
+
+/* Execution context passed to native code */
+struct jit_ctx {
+    float *scratch;
+    int frames;
+    struct sampleclock sc;
+};
+
+typedef void (*jit_func)(struct jit_ctx *ctx);
+
+/* Compiled tape */
+typedef struct _jit_code {
+    jit_func func;
+    void *mem;
+    size_t size;
+} *jit_code;
+
+/* Native code interface */
+int jit_supported(void);
+jit_code jit_compile(struct tape_op *ops, int size);
+void jit_free(jit_code code);
@@ -2,6 +2,7 @@
 
 /* POSIX */
 #include <unistd.h>
+#include <sched.h>
 
 /* C-stdlib */
 #include <stdlib.h>
@@ -20,24 +21,50 @@
 #include "sampleclock.h"
 #include "synth.h"
 #include "soundscript.h"
+#include "tape.h"
+#include "pool.h"
+#include "gen.h"
+#include "rt.h"
 
 static int msynth_parse_args(int argc, char *argv[]);
+static int msynth_offline(void);
 struct _msynth_config config;
 
 int main(int argc, char *argv[])
 {
     char *line;
 
-    srandom(20091989);
+    /* Keep decaying recursive graphs fast, every thread started from here
+     * on inherits this */
+    rt_flush_denormals(1);
 
     /* Handle commandline */
     if (msynth_parse_args(argc, argv))
         return config.exit_code;
 
+    /* Select evaluation engine */
+    if (config.native && tape_set_engine(TAPE_ENGINE_NATIVE))
+        puts("Native code is not supported on this platform,"
+            " using tape interpreter");
+
+    /* Render a script to a file, without audio device */
+    if (config.render_path)
+        return msynth_offline();
+
     /* Setup synthesizer */
+    rt_init();
+    pool_set_thread_init(rt_thread);
     soundscript_init();
+    pool_init(config.threads);
     msynth_init();
     puts("microsynth " MSYNTH_VERSION);
+    if (config.verbose)
+        printf("Shared wavetables: %lu KiB\n",
+            (unsigned long)gen_wavetables_size() / 1024);
+
+    /* Start playing the script all at once */
+    if (config.script_path)
+        soundscript_load(config.script_path);
 
     line = readline("msynth> ");
 
@@ -57,6 +84,27 @@ int main(int argc, char *argv[])
 
     /* Shutdown synthesizer */
     msynth_shutdown();
+    pool_shutdown();
+    soundscript_shutdown();
+
+    return config.exit_code;
+}
+
+/* Parse script and render it to config.render_path */
+static int msynth_offline(void)
+{
+    soundscript_init();
+    pool_init(config.threads);
+    msynth_init_offline();
+
+    /* Every line is handled as if it was typed at the prompt, a script
+     * with errors is not loaded at all */
+    if (soundscript_load(config.script_path))
+        config.exit_code = EXIT_FAILURE;
+    else if (msynth_render(config.render_path, config.render_seconds))
+        config.exit_code = EXIT_FAILURE;
+
+    pool_shutdown();
     soundscript_shutdown();
 
     return config.exit_code;
@@ -71,8 +119,17 @@ static int msynth_parse_args(int argc, char *argv[])
     config.buffer_time = config.period_time = -1;
     config.device_name = "default";
     config.verbose = 0;
+    config.native = 0;
+    config.threads = 1;
+    config.render_path = NULL;
+    config.render_seconds = 10.0f;
+    config.script_path = NULL;
+    config.rt_policy = SCHED_OTHER;
+    config.rt_priority = 70;
+    config.rt_cpus = NULL;
+    config.rt_lock = 0;
 
-    while ((arg = getopt(argc, argv, "s:rvb:p:d:h")) != -1) {
+    while ((arg = getopt(argc, argv, "s:rvb:p:d:jt:o:l:f:R:P:c:mh")) != -1) {
         switch (arg) {
             case 's':
                 config.srate = atoi(optarg);
@@ -98,8 +155,53 @@ static int msynth_parse_args(int argc, char *argv[])
                 config.device_name = optarg;
                 break;
 
+            case 'j':
+                config.native = 1;
+                break;
+
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+
+            case 'o':
+                config.render_path = optarg;
+                break;
+
+            case 'l':
+                config.render_seconds = atof(optarg);
+                break;
+
+            case 'f':
+                config.script_path = optarg;
+                break;
+
+            case 'R':
+                if (!strcmp(optarg, "fifo"))
+                    config.rt_policy = SCHED_FIFO;
+                else if (!strcmp(optarg, "rr"))
+                    config.rt_policy = SCHED_RR;
+                else {
+                    printf("Unknown scheduling policy %s, use fifo or rr.\n",
+                        optarg);
+                    config.exit_code = EXIT_FAILURE;
+                    return 1;
+                }
+                break;
+
+            case 'P':
+                config.rt_priority = atoi(optarg);
+                break;
+
+            case 'c':
+                config.rt_cpus = optarg;
+                break;
+
+            case 'm':
+                config.rt_lock = 1;
+                break;
+
             case 'h':
-                printf("Usage %s:\n"
+                printf("Usage %s [script]:\n"
                     "    -s Set samplerate (usually 48000 or 44100)\n"
                     "    -r Enable software resampling\n"
                     "    -b Set buffer time in microseconds\n"
@@ -117,6 +219,26 @@ static int msynth_parse_args(int argc, char *argv[])
                     "    maximized to reduce synthesis overhead.\n"
                     "\n"
                     "    -d Set ALSA device name (usually default or hw:0,0)\n"
+                    "    -j Compile sound graphs to native code.\n"
+                    "    -t Set the amount of threads evaluating independent\n"
+                    "       variables (default 1).\n"
+                    "    -o Render to a file instead of the sound card, a\n"
+                    "       .raw file receives raw floats, any other file\n"
+                    "       becomes a WAV file. The script is read from the\n"
+                    "       given file or standard input. Renders at 48000 Hz\n"
+                    "       unless set with -s.\n"
+                    "    -l Set the length to render in seconds"
+                    " (default 10).\n"
+                    "    -f Load a script at startup, at once. Same as\n"
+                    "       giving the script as argument.\n"
+                    "    -R Run the synth thread and workers with realtime\n"
+                    "       scheduling, fifo or rr. Falls back to normal\n"
+                    "       scheduling without the privileges for it.\n"
+                    "    -P Set the realtime priority (default 70).\n"
+                    "    -c Pin the synth thread and workers to CPUs, in\n"
+                    "       order (e.g. 2,3 or 0-3).\n"
+                    "    -m Lock all memory, so rendering never has to wait\n"
+                    "       for pages to be swapped in.\n"
                     "    -h Show this help.\n");
                 return 1;
 
@@ -135,6 +257,38 @@ static int msynth_parse_args(int argc, char *argv[])
         return 1;
     }
 
+    /* Script to load or render */
+    if (optind < argc)
+        config.script_path = argv[optind];
+
+    if (config.render_path && config.render_seconds < 0.0f) {
+        printf("The render length must not be negative.\n");
+        config.exit_code = EXIT_FAILURE;
+        return 1;
+    }
+
+    if (config.threads < 1) {
+        printf("The amount of threads must be at least 1.\n");
+        config.exit_code = EXIT_FAILURE;
+        return 1;
+    }
+
+    if (config.rt_policy != SCHED_OTHER &&
+            (config.rt_priority < sched_get_priority_min(config.rt_policy) ||
+            config.rt_priority > sched_get_priority_max(config.rt_policy))) {
+        printf("The realtime priority must be between %i and %i.\n",
+            sched_get_priority_min(config.rt_policy),
+            sched_get_priority_max(config.rt_policy));
+        config.exit_code = EXIT_FAILURE;
+        return 1;
+    }
+
+    if (config.rt_cpus && !rt_valid_cpus(config.rt_cpus)) {
+        printf("Invalid CPU list %s.\n", config.rt_cpus);
+        config.exit_code = EXIT_FAILURE;
+        return 1;
+    }
+
     return 0;
 }
 
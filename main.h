@@ -18,5 +18,20 @@ extern struct _msynth_config {
     unsigned int
         buffer_time,
         period_time;
+
+    /* Evaluation engine */
+    int native;
+    int threads;
+
+    /* Realtime scheduling, rt_cpus lists the CPUs to pin threads to */
+    int rt_policy;
+    int rt_priority;
+    char *rt_cpus;
+    int rt_lock;
+
+    /* Offline rendering, used when render_path is set */
+    char *render_path;
+    float render_seconds;
+    char *script_path;
 } config;
 
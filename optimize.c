@@ -0,0 +1,559 @@
+/* microsynth - Sound graph optimization
+ *
+ * Simplifies freshly parsed sound graphs before they are installed:
+ *  - Subtrees consisting of pure transforms of constants are folded.
+ *  - Division by a constant becomes multiplication by its reciprocal,
+ *    subtraction of a constant becomes addition of its negation.
+ *  - Identities such as x + 0, x * 1 and x[0] are removed, x * 0 and x / 0
+ *    become 0.
+ *  - Nested add and mul chains are flattened so all their constants
+ *    fold into a single one.
+ *
+ * Graphs are modified in place, the root node keeps its address. This is
+ * only safe on graphs that are not shared with anything else yet.
+ *
+ * Optimized graphs are then interned (hash-consed): structurally identical
+ * nodes, within one graph or across all installed graphs, are replaced by
+ * a single shared node so they are only evaluated once per sample.
+ * Nodes with state (oscillators, delays) start out fresh when installed,
+ * so they are only shared among the graphs installed by a single regroup.
+ * Delays of the same signal installed together also share a delay line.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "main.h"
+#include "sampleclock.h"
+#include "synth.h"
+#include "transform.h"
+#include "soundscript.h"
+#include "optimize.h"
+
+/* Sample clock passed to folded transforms, pure transforms ignore it */
+static struct sampleclock null_sc;
+
+/* Tables of shared nodes, map each interned node onto itself
+ *
+ * fresh_ht holds nodes with state that have not been evaluated yet.
+ */
+static GHashTable *cons_ht = NULL;
+static GHashTable *fresh_ht = NULL;
+
+/* Delay lines of the fresh delays, by their (interned) input signal */
+static GHashTable *line_ht = NULL;
+
+/* Local function definitions */
+static int _opt_is_pure1(msynth_modifier mod);
+static int _opt_is_pure2(msynth_modifier mod);
+static int _opt_is_const(msynth_modifier mod, float value);
+static void _opt_set_const(msynth_modifier mod, float value);
+static void _opt_replace(msynth_modifier mod, msynth_modifier child);
+static void _opt_collect_chain(msynth_modifier mod, msynth_modfunc2 func,
+    GPtrArray *nodes, GPtrArray *leaves);
+static void _opt_flatten(msynth_modifier mod);
+static void _opt_node(msynth_modifier mod);
+static int _opt_is_commutative(msynth_modifier mod);
+static int _opt_has_state(msynth_modifier mod);
+static void _opt_share_delay(msynth_modifier mod);
+static guint _opt_hash(gconstpointer key);
+static gboolean _opt_equal(gconstpointer a, gconstpointer b);
+
+/* Single input transforms without state or side effects */
+static int _opt_is_pure1(msynth_modifier mod)
+{
+    msynth_modfunc f = mod->data.node.func;
+
+    return f == tf_abs || f == tf_floor || f == tf_ceil || f == tf_chipify;
+}
+
+/* Dual input transforms without state or side effects */
+static int _opt_is_pure2(msynth_modifier mod)
+{
+    msynth_modfunc2 f = mod->data.node2.func;
+
+    return f == tf_add || f == tf_sub || f == tf_mul || f == tf_div ||
+        f == tf_min || f == tf_max || f == tf_clamp;
+}
+
+/* Check for constant node of the given value */
+static int _opt_is_const(msynth_modifier mod, float value)
+{
+    return mod->type == MSMT_CONSTANT && mod->data.constant == value;
+}
+
+/* Turn mod into a constant, freeing its inputs */
+static void _opt_set_const(msynth_modifier mod, float value)
+{
+    switch(mod->type) {
+        case MSMT_NODE1:
+            synth_free_recursive(mod->data.node.in);
+            break;
+
+        case MSMT_NODE2:
+            synth_free_recursive(mod->data.node2.a);
+            synth_free_recursive(mod->data.node2.b);
+            break;
+
+        case MSMT_VARIABLE:
+            free(mod->data.variable.name);
+            break;
+
+        default:;
+    }
+
+    synth_free_storage(mod);
+    mod->type = MSMT_CONSTANT;
+    mod->data.constant = value;
+
+    return;
+}
+
+/* Replace mod by its input child
+ *
+ * The child is moved into mod, all other inputs of mod are freed.
+ */
+static void _opt_replace(msynth_modifier mod, msynth_modifier child)
+{
+    if (mod->type == MSMT_NODE2) {
+        if (mod->data.node2.a != child)
+            synth_free_recursive(mod->data.node2.a);
+        if (mod->data.node2.b != child)
+            synth_free_recursive(mod->data.node2.b);
+    }
+
+    synth_free_storage(mod);
+    *mod = *child;
+    synth_free_modifier(child);
+
+    return;
+}
+
+/* Collect all nodes and leaves of a chain of func nodes */
+static void _opt_collect_chain(msynth_modifier mod, msynth_modfunc2 func,
+    GPtrArray *nodes, GPtrArray *leaves)
+{
+    if (mod->type == MSMT_NODE2 && mod->data.node2.func == func) {
+        g_ptr_array_add(nodes, mod);
+        _opt_collect_chain(mod->data.node2.a, func, nodes, leaves);
+        _opt_collect_chain(mod->data.node2.b, func, nodes, leaves);
+    } else {
+        g_ptr_array_add(leaves, mod);
+    }
+
+    return;
+}
+
+/* Flatten add/mul chain rooted at mod and fold its constants
+ *
+ * The chain is only rebuilt when there is something to fold, the
+ * non-constant inputs keep their order.
+ */
+static void _opt_flatten(msynth_modifier mod)
+{
+    GPtrArray *nodes, *leaves;
+    msynth_modifier leaf, node, acc = NULL;
+    msynth_modfunc2 func = mod->data.node2.func;
+    float constant, identity = func == tf_add ? 0.0f : 1.0f;
+    int i, n, constants = 0;
+
+    nodes = g_ptr_array_new();
+    leaves = g_ptr_array_new();
+    _opt_collect_chain(mod, func, nodes, leaves);
+
+    /* Fold all constants */
+    constant = identity;
+    for (i = 0; i < leaves->len; i++) {
+        leaf = g_ptr_array_index(leaves, i);
+        if (leaf->type == MSMT_CONSTANT) {
+            constant = func(null_sc, NULL, constant,
+                leaf->data.constant);
+            constants++;
+        }
+    }
+
+    /* Nothing to fold */
+    if (constants < 2) {
+        g_ptr_array_free(nodes, TRUE);
+        g_ptr_array_free(leaves, TRUE);
+        return;
+    }
+
+    /* Multiplying by 0 yields 0 */
+    if (func == tf_mul && constant == 0.0f) {
+        g_ptr_array_free(nodes, TRUE);
+        g_ptr_array_free(leaves, TRUE);
+        _opt_set_const(mod, 0.0f);
+        return;
+    }
+
+    /* Free constant leaves, keeping the first one for the folded value */
+    for (i = n = 0; i < leaves->len; i++) {
+        leaf = g_ptr_array_index(leaves, i);
+        if (leaf->type != MSMT_CONSTANT)
+            g_ptr_array_index(leaves, n++) = leaf;
+        else if (!acc)
+            acc = leaf;
+        else
+            synth_free_modifier(leaf);
+    }
+
+    /* Append folded constant unless it is the identity */
+    if (constant != identity || !n) {
+        acc->data.constant = constant;
+        g_ptr_array_index(leaves, n++) = acc;
+    } else {
+        synth_free_modifier(acc);
+    }
+
+    /* Rebuild left leaning chain, reusing the chain nodes. The root
+     * (nodes[0]) is overwritten with the result so it keeps its address.
+     */
+    acc = g_ptr_array_index(leaves, 0);
+    for (i = 1; i < n; i++) {
+        node = g_ptr_array_index(nodes, n - i);
+        node->data.node2.a = acc;
+        node->data.node2.b = g_ptr_array_index(leaves, i);
+        acc = node;
+    }
+
+    /* Free chain nodes no longer needed */
+    for (i = n; i < nodes->len; i++)
+        synth_free_modifier(g_ptr_array_index(nodes, i));
+
+    /* Move the result into the root */
+    *mod = *acc;
+    synth_free_modifier(acc);
+
+    g_ptr_array_free(nodes, TRUE);
+    g_ptr_array_free(leaves, TRUE);
+
+    return;
+}
+
+/* Optimize a single node, after its inputs */
+static void _opt_node(msynth_modifier mod)
+{
+    msynth_modifier a, b;
+
+    switch(mod->type) {
+        case MSMT_NODE1:
+            _opt_node(mod->data.node.in);
+            a = mod->data.node.in;
+
+            /* Delay of 0 samples */
+            if (ssb_is_delay(mod) && ssb_get_delay(mod) == 0) {
+                _opt_replace(mod, a);
+                return;
+            }
+
+            /* Constant input */
+            if (_opt_is_pure1(mod) && a->type == MSMT_CONSTANT)
+                _opt_set_const(mod, mod->data.node.func(null_sc,
+                    NULL, a->data.constant));
+            return;
+
+        case MSMT_NODE2:
+            _opt_node(mod->data.node2.a);
+            _opt_node(mod->data.node2.b);
+            a = mod->data.node2.a;
+            b = mod->data.node2.b;
+
+            if (!_opt_is_pure2(mod))
+                return;
+
+            /* Constant inputs */
+            if (a->type == MSMT_CONSTANT && b->type == MSMT_CONSTANT) {
+                _opt_set_const(mod, mod->data.node2.func(null_sc,
+                    NULL, a->data.constant, b->data.constant));
+                return;
+            }
+
+            /* Strength reduction, x / c = x * (1 / c), x - c = x + -c */
+            if (mod->data.node2.func == tf_div &&
+                    b->type == MSMT_CONSTANT) {
+                if (b->data.constant == 0.0f) {
+                    _opt_set_const(mod, 0.0f);
+                    return;
+                }
+
+                b->data.constant = 1.0f / b->data.constant;
+                mod->data.node2.func = tf_mul;
+                mod->data.node2.bfunc = tf_mul_block;
+            } else if (mod->data.node2.func == tf_sub &&
+                    b->type == MSMT_CONSTANT) {
+                b->data.constant = -b->data.constant;
+                mod->data.node2.func = tf_add;
+                mod->data.node2.bfunc = tf_add_block;
+            }
+
+            /* Identities */
+            if (mod->data.node2.func == tf_add) {
+                if (_opt_is_const(a, 0.0f)) {
+                    _opt_replace(mod, b);
+                    return;
+                }
+                if (_opt_is_const(b, 0.0f)) {
+                    _opt_replace(mod, a);
+                    return;
+                }
+            } else if (mod->data.node2.func == tf_mul) {
+                if (_opt_is_const(a, 0.0f) || _opt_is_const(b, 0.0f)) {
+                    _opt_set_const(mod, 0.0f);
+                    return;
+                }
+                if (_opt_is_const(a, 1.0f)) {
+                    _opt_replace(mod, b);
+                    return;
+                }
+                if (_opt_is_const(b, 1.0f)) {
+                    _opt_replace(mod, a);
+                    return;
+                }
+            }
+
+            /* Fold constants spread over a chain */
+            if (mod->data.node2.func == tf_add ||
+                    mod->data.node2.func == tf_mul)
+                _opt_flatten(mod);
+            return;
+
+        default:;
+    }
+
+    return;
+}
+
+/* Optimize sound graph
+ *
+ * Returns the optimized graph, which is always mod itself.
+ * NOTE: Recursion validation relies on delays, including delays of 0, so
+ *       graphs must be validated before being optimized.
+ */
+msynth_modifier opt_graph(msynth_modifier mod)
+{
+    int before = 0;
+
+    if (config.verbose)
+        before = opt_count_nodes(mod);
+
+    _opt_node(mod);
+
+    if (config.verbose)
+        printf("optimize: %i nodes reduced to %i\n", before,
+            opt_count_nodes(mod));
+
+    return mod;
+}
+
+/* Count nodes in sound graph */
+int opt_count_nodes(msynth_modifier mod)
+{
+    switch(mod->type) {
+        case MSMT_NODE1:
+            return 1 + opt_count_nodes(mod->data.node.in);
+
+        case MSMT_NODE2:
+            return 1 + opt_count_nodes(mod->data.node2.a) +
+                opt_count_nodes(mod->data.node2.b);
+
+        default:;
+    }
+
+    return 1;
+}
+
+/* Dual input transforms whose inputs may be swapped */
+static int _opt_is_commutative(msynth_modifier mod)
+{
+    msynth_modfunc2 f = mod->data.node2.func;
+
+    return f == tf_add || f == tf_mul;
+}
+
+/* Check whether node keeps state between samples */
+static int _opt_has_state(msynth_modifier mod)
+{
+    return (mod->type == MSMT_NODE1 && !_opt_is_pure1(mod)) ||
+        (mod->type == MSMT_NODE2 && !_opt_is_pure2(mod));
+}
+
+/* Hash node by its function and (already interned) inputs */
+static guint _opt_hash(gconstpointer key)
+{
+    msynth_modifier mod = (msynth_modifier)key;
+    guint32 bits;
+
+    switch(mod->type) {
+        case MSMT_CONSTANT:
+            memcpy(&bits, &mod->data.constant, sizeof(bits));
+            return bits;
+
+        case MSMT_VARIABLE:
+            return g_str_hash(mod->data.variable.name);
+
+        case MSMT_NODE1:
+            return g_direct_hash(mod->data.node.in) * 31 +
+                (ssb_is_delay(mod) ? ssb_get_delay(mod) : 0);
+
+        case MSMT_NODE2:
+            /* Symmetric, commutative inputs may be swapped */
+            return g_direct_hash(mod->data.node2.a) +
+                g_direct_hash(mod->data.node2.b);
+
+        default:;
+    }
+
+    return g_direct_hash(mod);
+}
+
+/* Compare nodes by their function and (already interned) inputs */
+static gboolean _opt_equal(gconstpointer a, gconstpointer b)
+{
+    msynth_modifier x = (msynth_modifier)a, y = (msynth_modifier)b;
+
+    if (x->type != y->type)
+        return FALSE;
+
+    switch(x->type) {
+        case MSMT_CONSTANT:
+            return !memcmp(&x->data.constant, &y->data.constant,
+                sizeof(x->data.constant));
+
+        case MSMT_VARIABLE:
+            return !strcmp(x->data.variable.name,
+                y->data.variable.name);
+
+        case MSMT_NODE1:
+            if (x->data.node.func != y->data.node.func ||
+                    x->data.node.in != y->data.node.in)
+                return FALSE;
+            return !ssb_is_delay(x) || ssb_get_delay(x) == ssb_get_delay(y);
+
+        case MSMT_NODE2:
+            if (x->data.node2.func != y->data.node2.func)
+                return FALSE;
+            if (x->data.node2.a == y->data.node2.a &&
+                    x->data.node2.b == y->data.node2.b)
+                return TRUE;
+            return _opt_is_commutative(x) &&
+                x->data.node2.a == y->data.node2.b &&
+                x->data.node2.b == y->data.node2.a;
+
+        default:;
+    }
+
+    return x == y;
+}
+
+/* Intern sound graph
+ *
+ * Returns the shared equivalent of mod, which takes over the reference
+ * to mod. When an identical node was installed before, mod is released
+ * and the existing node is returned instead. Temporary nodes are promoted
+ * to long-lived ones, see synth_promote.
+ * NOTE: Generators without input (whitenoise) differ on every call and
+ *       are never shared.
+ */
+msynth_modifier opt_intern(msynth_modifier mod)
+{
+    msynth_modifier shared;
+    GHashTable *table;
+
+    if (!cons_ht) {
+        cons_ht = g_hash_table_new(_opt_hash, _opt_equal);
+        fresh_ht = g_hash_table_new(_opt_hash, _opt_equal);
+        line_ht = g_hash_table_new_full(NULL, NULL, NULL,
+            (GDestroyNotify)tf_delay_line_release);
+    }
+
+    switch(mod->type) {
+        case MSMT_NODE0:
+            return synth_promote(mod);
+
+        case MSMT_NODE1:
+            mod->data.node.in = opt_intern(mod->data.node.in);
+            break;
+
+        case MSMT_NODE2:
+            mod->data.node2.a = opt_intern(mod->data.node2.a);
+            mod->data.node2.b = opt_intern(mod->data.node2.b);
+            break;
+
+        default:;
+    }
+
+    table = _opt_has_state(mod) ? fresh_ht : cons_ht;
+
+    /* Already shared (inputs of graphs installed before) */
+    shared = g_hash_table_lookup(table, mod);
+    if (shared == mod)
+        return mod;
+
+    if (shared) {
+        shared->refs++;
+        synth_free_recursive(mod);
+        return shared;
+    }
+
+    mod = synth_promote(mod);
+    g_hash_table_insert(table, mod, mod);
+
+    if (ssb_is_delay(mod))
+        _opt_share_delay(mod);
+
+    return mod;
+}
+
+/* Let delay mod share a single delay line with the other fresh delays of
+ * the same signal, such as x[100] and x[200]
+ */
+static void _opt_share_delay(msynth_modifier mod)
+{
+    tf_delay_info di = (tf_delay_info)mod->storage;
+    tf_delay_line line;
+
+    if (!di->line)
+        return;
+
+    line = g_hash_table_lookup(line_ht, mod->data.node.in);
+    if (line) {
+        tf_delay_share(di, line);
+    } else {
+        di->line->refs++;
+        g_hash_table_insert(line_ht, mod->data.node.in, di->line);
+    }
+
+    return;
+}
+
+/* Stop sharing the nodes with state interned so far
+ *
+ * Called once the installed graphs are about to be evaluated, graphs
+ * installed afterwards get their own fresh oscillators and delays.
+ */
+void opt_seal(void)
+{
+    if (fresh_ht) {
+        g_hash_table_remove_all(fresh_ht);
+        g_hash_table_remove_all(line_ht);
+    }
+
+    return;
+}
+
+/* Remove node from the table of shared nodes, called before freeing it */
+void opt_forget(msynth_modifier mod)
+{
+    if (!cons_ht)
+        return;
+
+    if (g_hash_table_lookup(cons_ht, mod) == mod)
+        g_hash_table_remove(cons_ht, mod);
+    else if (g_hash_table_lookup(fresh_ht, mod) == mod)
+        g_hash_table_remove(fresh_ht, mod);
+
+    return;
+}
@@ -0,0 +1,7 @@
+/* Sound graph optimization */
+
+msynth_modifier opt_graph(msynth_modifier mod);
+int opt_count_nodes(msynth_modifier mod);
+msynth_modifier opt_intern(msynth_modifier mod);
+void opt_forget(msynth_modifier mod);
+void opt_seal(void);
@@ -0,0 +1,211 @@
+/* microsynth - Worker pool
+ *
+ * Runs the independent parts of a job on several threads. The thread
+ * issuing a job takes part in it, so a pool of n threads starts n - 1
+ * workers. Indices are handed out one at a time through an atomic counter,
+ * so a worker finishing early simply takes the next one.
+ *
+ * The synth thread issues several jobs per block, so workers spin for a
+ * while waiting for the next job before going to sleep.
+ *
+ * Jobs are numbered: an odd job_gen means the job is open, an even job_gen
+ * means it is closed. Workers only take part in an open job and the job is
+ * not replaced before all workers taking part have left it.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "pool.h"
+
+/* Iterations spent spinning before sleeping or yielding */
+#define POOL_SPIN 20000
+
+/* Local function definitions */
+static void _pool_work(void);
+static void *_pool_worker(void *arg);
+
+/* Workers */
+static pthread_t *workers = NULL;
+static int threads = 1;
+static int quit = 0;
+
+/* Current job */
+static pool_func job_func;
+static void *job_arg;
+static int job_count;
+static int job_next = 0;
+static int job_done = 0;
+static int job_gen = 0;
+static int job_active = 0;
+
+/* Sleeping workers */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int sleepers = 0;
+
+/* Called first on every worker */
+static pool_thread_func thread_init = NULL;
+
+/* Start a pool of threads (including the calling thread) */
+void pool_init(int n)
+{
+    int i;
+
+    assert(!workers);
+
+    threads = n < 1 ? 1 : n;
+    quit = 0;
+    if (threads == 1)
+        return;
+
+    workers = malloc(sizeof(pthread_t) * (threads - 1));
+    assert(workers);
+
+    for (i = 0; i < threads - 1; i++) {
+        if (pthread_create(workers + i, NULL, _pool_worker,
+                (void *)(intptr_t)(i + 1))) {
+            fprintf(stderr, "error: Cannot start worker thread\n");
+            exit(1);
+        }
+    }
+
+    return;
+}
+
+/* Set the function every worker calls first with its index (from 1 up),
+ * takes effect for workers started afterwards */
+void pool_set_thread_init(pool_thread_func func)
+{
+    thread_init = func;
+
+    return;
+}
+
+/* Stop all workers */
+void pool_shutdown(void)
+{
+    int i;
+
+    if (!workers)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    __atomic_store_n(&quit, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&job_gen, 2, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    for (i = 0; i < threads - 1; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    workers = NULL;
+    threads = 1;
+
+    return;
+}
+
+/* Return the amount of threads in the pool */
+int pool_threads(void)
+{
+    return threads;
+}
+
+/* Call func(arg, i) for every i from 0 up to count, returns when all
+ * calls have completed. Calls may run concurrently and in any order.
+ */
+void pool_run(pool_func func, void *arg, int count)
+{
+    int i, spin = 0;
+
+    /* Not worth waking anybody */
+    if (threads == 1 || count < 2) {
+        for (i = 0; i < count; i++)
+            func(arg, i);
+        return;
+    }
+
+    job_func = func;
+    job_arg = arg;
+    job_count = count;
+    __atomic_store_n(&job_next, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&job_done, 0, __ATOMIC_RELAXED);
+
+    /* Open job */
+    __atomic_add_fetch(&job_gen, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    _pool_work();
+
+    while (__atomic_load_n(&job_done, __ATOMIC_ACQUIRE) < count)
+        if (++spin > POOL_SPIN)
+            sched_yield();
+
+    /* Close job, and wait for workers still looking at it */
+    __atomic_add_fetch(&job_gen, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&job_active, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    return;
+}
+
+/* Take part in the current job */
+static void _pool_work(void)
+{
+    int i;
+
+    while ((i = __atomic_fetch_add(&job_next, 1, __ATOMIC_RELAXED))
+            < job_count) {
+        job_func(job_arg, i);
+        __atomic_add_fetch(&job_done, 1, __ATOMIC_RELEASE);
+    }
+
+    return;
+}
+
+/* Worker thread main */
+static void *_pool_worker(void *arg)
+{
+    int gen = 0, spin;
+
+    if (thread_init)
+        thread_init((int)(intptr_t)arg);
+
+    for (;;) {
+        /* Wait for the job to change */
+        for (spin = 0; spin < POOL_SPIN &&
+                __atomic_load_n(&job_gen, __ATOMIC_ACQUIRE) == gen; spin++);
+
+        if (__atomic_load_n(&job_gen, __ATOMIC_ACQUIRE) == gen) {
+            pthread_mutex_lock(&mutex);
+            __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&job_gen, __ATOMIC_SEQ_CST) == gen)
+                pthread_cond_wait(&cond, &mutex);
+            __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        if (__atomic_load_n(&quit, __ATOMIC_ACQUIRE))
+            break;
+
+        gen = __atomic_load_n(&job_gen, __ATOMIC_ACQUIRE);
+        if (!(gen & 1))
+            continue;
+
+        /* Take part, unless the job was closed in the meantime */
+        __atomic_add_fetch(&job_active, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&job_gen, __ATOMIC_SEQ_CST) == gen)
+            _pool_work();
+        __atomic_sub_fetch(&job_active, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,14 @@
+/* Worker pool */
+
+/* Job function, called once for every index of a job */
+typedef void (*pool_func)(void *arg, int index);
+
+/* Thread setup function, called on every worker with its index */
+typedef void (*pool_thread_func)(int index);
+
+/* Worker pool interface */
+void pool_init(int threads);
+void pool_set_thread_init(pool_thread_func func);
+void pool_shutdown(void);
+int pool_threads(void);
+void pool_run(pool_func func, void *arg, int count);
@@ -0,0 +1,146 @@
+/* microsynth - Region allocator
+ *
+ * Bump allocator for temporaries, such as everything built while parsing a
+ * single line. Objects are never freed on their own, the whole region is
+ * reset in one step instead. Chunks are kept on reset and reused by the
+ * next round of allocations, so steady use does not touch the heap.
+ *
+ * Regions are not thread safe, only the control thread uses them.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "region.h"
+
+/* Bytes per chunk, larger objects get a chunk of their own */
+#define REGION_CHUNK 65536
+
+/* Alignment of all objects */
+#define REGION_ALIGN 16
+
+/* Chunk header, followed by the memory handed out */
+struct region_chunk {
+    struct region_chunk *next;
+    size_t size;
+};
+
+/* Room for the header, keeping objects aligned */
+#define REGION_HEADER \
+    ((sizeof(struct region_chunk) + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1))
+
+struct _region {
+    /* All chunks, and the one currently carved */
+    struct region_chunk *first, *current;
+    char *pos, *end;
+
+    size_t reserved;
+};
+
+/* Create empty region */
+region region_new(void)
+{
+    region r = malloc(sizeof(struct _region));
+    assert(r);
+
+    r->first = r->current = NULL;
+    r->pos = r->end = NULL;
+    r->reserved = 0;
+
+    return r;
+}
+
+/* Allocate chunk of at least size bytes, linked after the current one */
+static void _region_grow(region r, size_t size)
+{
+    struct region_chunk *chunk;
+
+    if (size < REGION_CHUNK)
+        size = REGION_CHUNK;
+
+    chunk = malloc(REGION_HEADER + size);
+    if (!chunk) {
+        perror("_region_grow.malloc");
+        exit(1);
+    }
+    chunk->size = size;
+    r->reserved += size;
+
+    if (r->current) {
+        chunk->next = r->current->next;
+        r->current->next = chunk;
+    } else {
+        chunk->next = r->first;
+        r->first = chunk;
+    }
+    r->current = chunk;
+
+    return;
+}
+
+/* Allocate (uninitialized) object of size bytes */
+void *region_alloc(region r, size_t size)
+{
+    struct region_chunk *next;
+    void *obj;
+
+    size = (size + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1);
+
+    if (r->pos + size > r->end) {
+        /* Reuse the following chunk if it fits, kept from before a reset */
+        next = r->current ? r->current->next : r->first;
+        if (next && next->size >= size)
+            r->current = next;
+        else
+            _region_grow(r, size);
+
+        r->pos = (char *)r->current + REGION_HEADER;
+        r->end = r->pos + r->current->size;
+    }
+
+    obj = r->pos;
+    r->pos += size;
+
+    return obj;
+}
+
+/* Copy string into region */
+char *region_strdup(region r, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(region_alloc(r, len), str, len);
+}
+
+/* Return whether ptr was allocated from r since the last reset */
+int region_owns(region r, const void *ptr)
+{
+    struct region_chunk *chunk;
+    const char *p = ptr, *start;
+
+    for (chunk = r->first; chunk; chunk = chunk->next) {
+        start = (char *)chunk + REGION_HEADER;
+        if (start <= p && p < start + chunk->size)
+            return 1;
+
+        if (chunk == r->current)
+            break;
+    }
+
+    return 0;
+}
+
+/* Discard all objects at once, keeping the chunks for reuse */
+void region_reset(region r)
+{
+    r->current = NULL;
+    r->pos = r->end = NULL;
+
+    return;
+}
+
+/* Return the amount of bytes reserved by the region */
+size_t region_reserved(region r)
+{
+    return r->reserved;
+}
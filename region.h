@@ -0,0 +1,10 @@
+/* Region allocator */
+typedef struct _region *region;
+
+/* Region interface */
+region region_new(void);
+void *region_alloc(region r, size_t size);
+char *region_strdup(region r, const char *str);
+int region_owns(region r, const void *ptr);
+void region_reset(region r);
+size_t region_reserved(region r);
@@ -0,0 +1,235 @@
+/* microsynth - Realtime scheduling
+ *
+ * Keeps the synth thread (and the workers helping it) from being preempted
+ * or page faulting while rendering:
+ *  - Threads run under SCHED_FIFO or SCHED_RR at the configured priority.
+ *  - Threads are pinned to the configured CPUs, the synth thread to the
+ *    first, workers to the following ones (wrapping around).
+ *  - All memory is locked, including everything allocated later, and the
+ *    stack of every thread is faulted in up front.
+ *
+ * Every step falls back to normal operation when the process lacks the
+ * privileges, which is logged once. Threads only clear the flags of the
+ * settings they could not apply, rt_describe reports what is in effect.
+ *
+ * Independent of these settings, denormal floats are flushed to zero
+ * (rt_flush_denormals). Recursive graphs decay into denormals once their
+ * input goes silent, which the CPU computes on an order of magnitude
+ * slower than normal floats.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#if defined(__SSE2__)
+#include <pmmintrin.h>
+#endif
+
+#include "main.h"
+#include "rt.h"
+
+/* Bytes of stack faulted in by every thread */
+#define RT_STACK (256 * 1024)
+
+/* Settings in effect, may be less than configured, rt_policy and rt_pinned
+ * are cleared atomically by the threads */
+static int rt_policy = SCHED_OTHER;
+static int rt_locked = 0;
+static int rt_pinned = 0;
+
+/* Description of the settings, rebuilt under rt_mutex when they changed */
+static pthread_mutex_t rt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char rt_description[128];
+static int rt_described_policy = -1;
+static int rt_described_pinned = -1;
+
+/* Fault in the stack below the caller, so rendering never faults on it */
+static void __attribute__((noinline)) _rt_prefault_stack(void)
+{
+    char stack[RT_STACK];
+    volatile char *page = stack;
+    int i;
+
+    for (i = 0; i < RT_STACK; i += 4096)
+        page[i] = 0;
+
+    return;
+}
+
+/* Return the CPU for thread index from the configured list, -1 if the list
+ * is invalid
+ *
+ * The list holds CPU numbers and ranges, such as 2,3 or 0-3.
+ */
+static int _rt_cpu(const char *list, int index)
+{
+    int cpus[CPU_SETSIZE], n = 0, first, last;
+    char *end;
+
+    while (*list && n < CPU_SETSIZE) {
+        first = last = strtol(list, &end, 10);
+        if (end == list)
+            return -1;
+
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list)
+                return -1;
+        }
+
+        if (first < 0 || last >= CPU_SETSIZE || first > last)
+            return -1;
+        while (first <= last && n < CPU_SETSIZE)
+            cpus[n++] = first++;
+
+        list = end;
+        if (*list == ',')
+            list++;
+        else if (*list)
+            return -1;
+    }
+
+    return n ? cpus[index % n] : -1;
+}
+
+/* Describe the settings policy and pinned, called with rt_mutex held */
+static void _rt_describe(int policy, int pinned)
+{
+    char scheduling[32];
+
+    if (policy == SCHED_OTHER)
+        strcpy(scheduling, "normal scheduling");
+    else
+        snprintf(scheduling, sizeof(scheduling), "%s %i",
+            policy == SCHED_FIFO ? "fifo" : "rr", config.rt_priority);
+
+    snprintf(rt_description, sizeof(rt_description), "%s%s%s", scheduling,
+        pinned ? ", pinned" : "", rt_locked ? ", memory locked" : "");
+    rt_described_policy = policy;
+    rt_described_pinned = pinned;
+
+    return;
+}
+
+/* Flush denormal results and inputs of float operations to zero on the
+ * calling thread (flush is 1) or not (flush is 0)
+ *
+ * Threads inherit the setting of the thread starting them, so main sets it
+ * before starting any. Returns -1 if the CPU cannot flush denormals, in
+ * which case SYNTH_FLUSH protects the state of recursive graphs.
+ */
+int rt_flush_denormals(int flush)
+{
+#if defined(__SSE2__)
+    _MM_SET_FLUSH_ZERO_MODE(flush ? _MM_FLUSH_ZERO_ON : _MM_FLUSH_ZERO_OFF);
+    _MM_SET_DENORMALS_ZERO_MODE(flush ? _MM_DENORMALS_ZERO_ON :
+        _MM_DENORMALS_ZERO_OFF);
+    return 0;
+#elif defined(__aarch64__)
+    unsigned long fpcr;
+
+    /* FZ bit of the floating point control register */
+    __asm__ __volatile__("mrs %0, fpcr" : "=r" (fpcr));
+    fpcr = flush ? fpcr | (1UL << 24) : fpcr & ~(1UL << 24);
+    __asm__ __volatile__("msr fpcr, %0" : : "r" (fpcr));
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Return whether list is a valid CPU list */
+int rt_valid_cpus(const char *list)
+{
+    return _rt_cpu(list, 0) >= 0;
+}
+
+/* Lock all memory of the process, when configured
+ *
+ * Called before starting any threads. The heap is neither trimmed nor
+ * grown with separate mappings afterwards, so freed memory stays locked
+ * and is reused.
+ */
+void rt_init(void)
+{
+    rt_policy = config.rt_policy;
+    rt_pinned = config.rt_cpus != NULL;
+
+    if (config.rt_lock) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+            fprintf(stderr, "rt: Cannot lock memory (%s), continuing"
+                " without\n", strerror(errno));
+        } else {
+            mallopt(M_TRIM_THRESHOLD, -1);
+            mallopt(M_MMAP_MAX, 0);
+            rt_locked = 1;
+        }
+    }
+
+    return;
+}
+
+/* Apply the realtime settings to the calling thread
+ *
+ * index is 0 for the synth thread and counts up for the workers.
+ */
+void rt_thread(int index)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    int err, cpu, policy;
+
+    policy = __atomic_load_n(&rt_policy, __ATOMIC_SEQ_CST);
+    if (policy != SCHED_OTHER) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config.rt_priority;
+
+        /* Only the first thread failing reports it */
+        err = pthread_setschedparam(pthread_self(), policy, &param);
+        if (err && __atomic_exchange_n(&rt_policy, SCHED_OTHER,
+                __ATOMIC_SEQ_CST) != SCHED_OTHER)
+            fprintf(stderr, "rt: Cannot use realtime scheduling (%s),"
+                " continuing with normal scheduling\n", strerror(err));
+    }
+
+    if (config.rt_cpus) {
+        cpu = _rt_cpu(config.rt_cpus, index);
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err && __atomic_exchange_n(&rt_pinned, 0, __ATOMIC_SEQ_CST))
+            fprintf(stderr, "rt: Cannot pin thread %i to CPU %i (%s),"
+                " continuing unpinned\n", index, cpu, strerror(err));
+    }
+
+    if (rt_locked)
+        _rt_prefault_stack();
+
+    return;
+}
+
+/* Return a description of the realtime settings in effect
+ *
+ * The description is only rewritten when a thread gave up a setting since
+ * it was last built, which happens at most twice.
+ */
+const char *rt_describe(void)
+{
+    int policy, pinned;
+
+    pthread_mutex_lock(&rt_mutex);
+    policy = __atomic_load_n(&rt_policy, __ATOMIC_SEQ_CST);
+    pinned = __atomic_load_n(&rt_pinned, __ATOMIC_SEQ_CST);
+    if (policy != rt_described_policy || pinned != rt_described_pinned)
+        _rt_describe(policy, pinned);
+    pthread_mutex_unlock(&rt_mutex);
+
+    return rt_description;
+}
@@ -0,0 +1,6 @@
+/* Realtime setup of the synth thread and workers */
+int rt_flush_denormals(int flush);
+int rt_valid_cpus(const char *list);
+void rt_init(void);
+void rt_thread(int index);
+const char *rt_describe(void);
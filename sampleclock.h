@@ -1,12 +1,15 @@
 /* Microsynth sample clock */
+#include <stdint.h>
 
+/* The sample count does not overflow within any sensible uptime, the clock
+ * is advanced incrementally without any division */
 struct sampleclock {
     int samplerate;
-    int samples;
-    float seconds;
-    float cycle;
+    int64_t samples;
+    double period;  /* Seconds per sample */
 };
 
-struct sampleclock sc_from_samples(int samplerate, int samples);
+struct sampleclock sc_from_samples(int samplerate, int64_t samples);
+struct sampleclock sc_advance(struct sampleclock sc, int samples);
 struct sampleclock sc_rewind(struct sampleclock sc, int samples);
 
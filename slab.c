@@ -0,0 +1,101 @@
+/* microsynth - Slab allocator
+ *
+ * Hands out objects of a single size, carved in sequence from large
+ * chunks, so objects allocated one after another (such as the nodes of a
+ * freshly built graph) lie next to each other in memory. Freed objects are
+ * kept on a free list and reused before carving further. Chunks are never
+ * returned to the system.
+ *
+ * Slabs are not thread safe, only the control thread allocates and frees.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "slab.h"
+
+/* Bytes per chunk */
+#define SLAB_CHUNK 65536
+
+/* Freed object, linked into the free list */
+struct slab_free {
+    struct slab_free *next;
+};
+
+struct _slab {
+    size_t size;
+
+    /* Free list, and the part of the current chunk not carved yet */
+    struct slab_free *free;
+    char *pos, *end;
+
+    size_t reserved;
+};
+
+/* Create slab of objects of size bytes, aligned to align bytes (a power
+ * of two)
+ */
+slab slab_new(size_t size, size_t align)
+{
+    slab s = malloc(sizeof(struct _slab));
+    assert(s);
+
+    if (size < sizeof(struct slab_free))
+        size = sizeof(struct slab_free);
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    s->size = (size + align - 1) & ~(align - 1);
+    s->free = NULL;
+    s->pos = s->end = NULL;
+    s->reserved = 0;
+
+    return s;
+}
+
+/* Allocate an (uninitialized) object */
+void *slab_alloc(slab s)
+{
+    struct slab_free *obj;
+    void *chunk;
+
+    if (s->free) {
+        obj = s->free;
+        s->free = obj->next;
+        return obj;
+    }
+
+    if (s->pos + s->size > s->end) {
+        /* Chunks are aligned to 64 bytes, the largest alignment used */
+        if (posix_memalign(&chunk, 64, SLAB_CHUNK)) {
+            perror("slab_alloc.posix_memalign");
+            exit(1);
+        }
+
+        s->pos = chunk;
+        s->end = s->pos + SLAB_CHUNK;
+        s->reserved += SLAB_CHUNK;
+    }
+
+    obj = (struct slab_free *)s->pos;
+    s->pos += s->size;
+
+    return obj;
+}
+
+/* Return object to the slab */
+void slab_free(slab s, void *obj)
+{
+    struct slab_free *f = obj;
+
+    f->next = s->free;
+    s->free = f;
+
+    return;
+}
+
+/* Return the amount of bytes reserved by the slab */
+size_t slab_reserved(slab s)
+{
+    return s->reserved;
+}
@@ -0,0 +1,8 @@
+/* Slab allocator */
+typedef struct _slab *slab;
+
+/* Slab interface */
+slab slab_new(size_t size, size_t align);
+void *slab_alloc(slab s);
+void slab_free(slab s, void *obj);
+size_t slab_reserved(slab s);
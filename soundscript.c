@@ -1,5 +1,7 @@
 /* microsynth - Sound scripting */
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <pthread.h>
 #include <assert.h>
 #include <glib.h>
@@ -11,11 +13,36 @@
 #include "soundscript_lex.h"
 #include "soundscript_parse.h"
 #include "soundscript.h"
+#include "tape.h"
+#include "optimize.h"
+#include "region.h"
 
 /* Local function definitions */
 static soundscript_var _ssv_alloc_var(void);
-static void _ssv_recursively_mark_graphs(msynth_modifier mod);
+static void _ssv_assign(char *vname, msynth_modifier mod, int recursive);
+static void _ssv_mark_reachable(soundscript_var var, GPtrArray *visited);
+static void _ssv_collect_graph_vars(msynth_modifier mod, GPtrArray *vars);
+static int _ssv_search_users(soundscript_var var, int ub, GPtrArray *visited);
+static void _ssv_unmark(GPtrArray *visited, unsigned int clear);
 static int _ssv_validate_recursion(msynth_modifier mod, int can_reference);
+static int _ssv_needs_sample_eval(soundscript_var var);
+static void _ssv_bind_graph(soundscript_var var, msynth_modifier mod);
+static void _ssv_unlink_deps(soundscript_var var);
+static void _ssv_reorder(soundscript_var dep, soundscript_var var);
+static void _ssv_assign_pending(char *vname, msynth_modifier mod,
+    int recursive);
+static void _ssv_free_var(soundscript_var var);
+static int _ssv_pending_cycle(soundscript_var var, GPtrArray *visited);
+static void _ssv_sort_visit(soundscript_var var, GPtrArray *order);
+static void _ssv_sort(void);
+static int _ss_parse_line(char *line);
+static int _ss_load(char *path);
+static int _ss_check_pending(const char *name);
+static void _ss_install_pending(void);
+static void _ss_discard_pending(void);
+
+/* Scripts loaded by scripts, at most */
+#define SS_LOAD_DEPTH 16
 
 /* Cast override functions (work around for warnings) */
 #define __DEF_FORCE_CAST(INTYPE, OUTTYPE, NAME) \
@@ -35,53 +62,306 @@ __DEF_FORCE_CAST(msynth_modfunc2, void*, from_func2)
 __DEF_FORCE_CAST(void*, msynth_modfunc0, to_func0)
 __DEF_FORCE_CAST(void*, msynth_modfunc, to_func1)
 __DEF_FORCE_CAST(void*, msynth_modfunc2, to_func2)
+__DEF_FORCE_CAST(msynth_blockfunc0, void*, from_bfunc0)
+__DEF_FORCE_CAST(msynth_blockfunc, void*, from_bfunc1)
+__DEF_FORCE_CAST(msynth_blockfunc2, void*, from_bfunc2)
+__DEF_FORCE_CAST(void*, msynth_blockfunc0, to_bfunc0)
+__DEF_FORCE_CAST(void*, msynth_blockfunc, to_bfunc1)
+__DEF_FORCE_CAST(void*, msynth_blockfunc2, to_bfunc2)
 
 /* Soundscript function definition */
 struct ss_func_def {
     void *func;
+    void *bfunc;
     int args;
+
+    /* Bytes of local storage, allocated along with every node */
+    size_t storage;
+
+    /* Called on the storage of every new node, if set */
+    void (*init)(void *storage);
 };
 
-/* Soundscript GC */
-static GHashTable *gc_ht = NULL;
+/* Temporaries of the line being parsed, see soundscript_parse */
+static region parse_region = NULL;
 
 /* Symbol table */
 static GHashTable *symtab; /* Function table */
 static GHashTable *vartab; /* Variable table */
 
+/* All variables in evaluation order, see _ssv_reorder */
+static GPtrArray *var_order;
+
 /* Variable evaluation array */
 static soundscript_var *eval_list = NULL;
 static int eval_recursive = 0;
 
-/* Parse a command line */
-void soundscript_parse(char *line)
-{
+/* Block evaluation state
+ *
+ * eval_block: Variables before this index are evaluated a block at a time,
+ *             all others are evaluated sample by sample.
+ * eval_tape: All variables lowered in evaluation order. This is the only
+ *            state shared with the synth thread, it is published with an
+ *            atomic pointer swap.
+ */
+static int eval_block = 0;
+static synth_tape eval_tape = NULL;
 
-    char *mod_str;
-    int len;
+/* Script loading state, see _ss_load
+ *
+ * pending_tab: Assignments of the script being loaded, by variable name.
+ *              Variables are looked up here first, so every line sees the
+ *              lines before it, but nothing is installed until the whole
+ *              script has been read.
+ * pending_names: Their names, in order of first assignment.
+ * load_path: Script to read once the line being parsed is done.
+ */
+static GHashTable *pending_tab = NULL;
+static GPtrArray *pending_names = NULL;
+static char *load_path = NULL;
+
+/* Parse a single line, as typed at the prompt, without regrouping
+ *
+ * The caller holds the graph lock. A line loading a script fails when any
+ * line of the script does. Returns 0 on success.
+ */
+static int _ss_parse_line(char *line)
+{
+    char *mod_str, *path;
+    int len, err;
     YY_BUFFER_STATE x;
 
+    /* Everything parsed is temporary, until accepted */
+    if (!parse_region)
+        parse_region = region_new();
+
     /* Build string with appended newline */
     len = strlen(line);
-    mod_str = malloc(sizeof(char) * len + 3);
+    mod_str = region_alloc(parse_region, sizeof(char) * len + 3);
     memcpy(mod_str, line, sizeof(char) * len);
     mod_str[len] = '\n';
     mod_str[len + 1] = '\0';
     mod_str[len + 2] = '\0';
 
-    /* Ensure no synthesis will take place while we modify
-     * the sound graphs
-     */
-    synth_lock_graphs();
-
     /* Parse string */
+    synth_begin_temporary(parse_region);
     x = yy_scan_buffer(mod_str, len + 3);
-    yyparse();
+    err = yyparse();
     yy_delete_buffer(x);
 
-    /* Clean up */
-    soundscript_run_gc();
-    free(mod_str);
+    /* Clean up, discarding all temporaries at once */
+    synth_end_temporary();
+    region_reset(parse_region);
+
+    /* Scripts are read once the line loading them is done */
+    path = load_path;
+    load_path = NULL;
+    if (path) {
+        if (!err)
+            err = _ss_load(path) != 0;
+        free(path);
+    }
+
+    return err;
+}
+
+/* Parse every line of a script, without regrouping
+ *
+ * The caller holds the graph lock. Reading stops at a line reading "quit".
+ * Scripts may load other scripts, up to SS_LOAD_DEPTH deep. Assignments
+ * are kept pending until the outermost script has been read, then checked
+ * as a whole and installed at once. If any line failed, all of them are
+ * discarded and the variables are left as they were.
+ * Returns the amount of lines with errors, -1 if the script cannot be
+ * read.
+ */
+static int _ss_load(char *path)
+{
+    static int depth = 0;
+    FILE *script = stdin;
+    const char *name = path ? path : "<stdin>";
+    char *line = NULL;
+    size_t alloc = 0;
+    ssize_t len;
+    int lineno = 0, errors = 0;
+
+    if (depth == SS_LOAD_DEPTH) {
+        fprintf(stderr, "%s: Scripts are loaded too deep\n", name);
+        return -1;
+    }
+
+    if (path) {
+        script = fopen(path, "r");
+        if (!script) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    if (!depth) {
+        pending_tab = g_hash_table_new(g_str_hash, g_str_equal);
+        pending_names = g_ptr_array_new();
+    }
+
+    depth++;
+    while ((len = getline(&line, &alloc, script)) != -1) {
+        lineno++;
+        if (len && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (!strcmp(line, "quit"))
+            break;
+
+        if (_ss_parse_line(line)) {
+            fprintf(stderr, "%s:%i: Failed: %s\n", name, lineno, line);
+            errors++;
+        }
+    }
+    depth--;
+
+    free(line);
+    if (script != stdin)
+        fclose(script);
+
+    if (!depth) {
+        if (!errors && _ss_check_pending(name))
+            errors++;
+
+        if (errors) {
+            fprintf(stderr, "%s: Script not loaded\n", name);
+            _ss_discard_pending();
+        } else {
+            _ss_install_pending();
+        }
+    }
+
+    return errors;
+}
+
+/* Check the pending assignments as a whole, returns 0 if they can be
+ * installed
+ *
+ * Each line was checked when it was parsed, as it would be at the prompt,
+ * except for cycles: a later line may break a cycle an earlier one made,
+ * so the normal variables are only checked not to read each other in a
+ * cycle once all assignments are known.
+ */
+static int _ss_check_pending(const char *name)
+{
+    GPtrArray *visited;
+    soundscript_var p;
+    char *vname;
+    int i, err = 0;
+
+    visited = g_ptr_array_new();
+    for (i = 0; i < pending_names->len && !err; i++) {
+        vname = g_ptr_array_index(pending_names, i);
+        p = g_hash_table_lookup(pending_tab, vname);
+
+        if (!p->recursive && _ssv_pending_cycle(p, visited)) {
+            fprintf(stderr, "%s: Assignment of '%s' would cause cycle in"
+                " soundgraph, use recursive variables instead\n", name,
+                vname);
+            err = 1;
+        }
+    }
+    _ssv_unmark(visited, 0x300);
+    g_ptr_array_free(visited, TRUE);
+
+    return err;
+}
+
+/* Install the pending assignments
+ *
+ * Graphs are bound once all variables exist, then the evaluation order is
+ * rebuilt in one pass, instead of being repaired after every assignment.
+ */
+static void _ss_install_pending(void)
+{
+    GHashTable *pending = pending_tab;
+    GPtrArray *assigned;
+    soundscript_var p, v;
+    char *vname;
+    int i;
+
+    /* Only the installed variables are looked up from here on */
+    pending_tab = NULL;
+    assigned = g_ptr_array_sized_new(pending_names->len);
+
+    for (i = 0; i < pending_names->len; i++) {
+        vname = g_ptr_array_index(pending_names, i);
+        p = g_hash_table_lookup(pending, vname);
+        v = g_hash_table_lookup(vartab, vname);
+
+        /* Replace the graph of an existing variable, or install the new
+         * variable itself */
+        if (v) {
+            synth_free_recursive(v->vargraph);
+            _ssv_unlink_deps(v);
+            v->vargraph = p->vargraph;
+            v->recursive = p->recursive;
+            v->pending = NULL;
+            _ssv_free_var(p);
+            free(vname);
+        } else {
+            v = p;
+            v->order = var_order->len;
+            g_ptr_array_add(var_order, v);
+            g_hash_table_insert(vartab, vname, v);
+        }
+
+        g_ptr_array_add(assigned, v);
+    }
+
+    for (i = 0; i < assigned->len; i++) {
+        v = g_ptr_array_index(assigned, i);
+        _ssv_bind_graph(v, v->vargraph);
+    }
+    _ssv_sort();
+
+    g_ptr_array_free(assigned, TRUE);
+    g_ptr_array_free(pending_names, TRUE);
+    g_hash_table_destroy(pending);
+    pending_names = NULL;
+
+    return;
+}
+
+/* Discard the pending assignments, leaving the variables as they were */
+static void _ss_discard_pending(void)
+{
+    soundscript_var p, v;
+    char *vname;
+    int i;
+
+    for (i = 0; i < pending_names->len; i++) {
+        vname = g_ptr_array_index(pending_names, i);
+        p = g_hash_table_lookup(pending_tab, vname);
+        v = g_hash_table_lookup(vartab, vname);
+
+        if (v)
+            v->pending = NULL;
+        synth_free_recursive(p->vargraph);
+        _ssv_free_var(p);
+        free(vname);
+    }
+
+    g_ptr_array_free(pending_names, TRUE);
+    g_hash_table_destroy(pending_tab);
+    pending_names = NULL;
+    pending_tab = NULL;
+
+    return;
+}
+
+/* Parse a command line */
+void soundscript_parse(char *line)
+{
+    /* Serialize edits, the synth thread never takes this lock and keeps
+     * running the previously published tape.
+     */
+    synth_lock_graphs();
+
+    _ss_parse_line(line);
 
     /* Update variable evaluation order */
     ssv_regroup();
@@ -92,8 +372,45 @@ void soundscript_parse(char *line)
     return;
 }
 
+/* Load a script, or standard input when path is NULL
+ *
+ * Every line is parsed as if typed at the prompt, but the graph lock is
+ * held throughout and the variables are regrouped only once, when all lines
+ * have been parsed. The synth thread keeps playing the graphs from before
+ * the script until the whole script takes effect at once, and loading
+ * takes time linear in the size of the script. Lines with errors are
+ * reported, after which none of the script takes effect (commands such as
+ * volume excepted, they are carried out as they are read).
+ *
+ * Returns the amount of lines with errors, -1 if the script cannot be
+ * read.
+ */
+int soundscript_load(char *path)
+{
+    int errors;
+
+    synth_lock_graphs();
+    errors = _ss_load(path);
+    if (!errors)
+        ssv_regroup();
+    synth_unlock_graphs();
+
+    return errors;
+}
+
+/* Read script path once the line being parsed is done, called by the
+ * parser, which is not reentrant */
+void soundscript_queue_load(char *path)
+{
+    free(load_path);
+    load_path = strdup(path);
+    assert(load_path);
+
+    return;
+}
+
 /* Generate function definition */
-gpointer ssi_def_func(void *func, int args)
+gpointer ssi_def_func(void *func, void *bfunc, int args, size_t storage)
 {
     struct ss_func_def *def;
     def = malloc(sizeof(struct ss_func_def));
@@ -104,6 +421,9 @@ gpointer ssi_def_func(void *func, int args)
 
     def->args = args;
     def->func = func;
+    def->bfunc = bfunc;
+    def->storage = storage;
+    def->init = NULL;
 
     return def;
 }
@@ -111,54 +431,87 @@ gpointer ssi_def_func(void *func, int args)
 /* Initialize soundscript subsystem - THIS FUNCTION MUST BE CALLED BEFORE msynth_init */
 void soundscript_init()
 {
-    gc_ht = g_hash_table_new(NULL, NULL);
+    struct ss_func_def *def;
+
     symtab = g_hash_table_new(g_str_hash, g_str_equal);
     vartab = g_hash_table_new(g_str_hash, g_str_equal);
+    var_order = g_ptr_array_new();
+    gen_init();
 
     /* Setup built-in functions */
 
     /* Oscillators */
-    g_hash_table_insert(symtab, "sin", ssi_def_func(__force_cast_from_func1(gen_sin), 1));
+    g_hash_table_insert(symtab, "sin", ssi_def_func(
+        __force_cast_from_func1(gen_sin),
+        __force_cast_from_bfunc1(gen_sin_block), 1,
+        gen_storage_size()));
     g_hash_table_insert(symtab, "cos", ssi_def_func(
-        __force_cast_from_func1(gen_cos), 1));
+        __force_cast_from_func1(gen_cos),
+        __force_cast_from_bfunc1(gen_cos_block), 1,
+        gen_storage_size()));
     g_hash_table_insert(symtab, "saw", ssi_def_func(
-        __force_cast_from_func1(gen_saw), 1));
+        __force_cast_from_func1(gen_saw),
+        __force_cast_from_bfunc1(gen_saw_block), 1,
+        gen_storage_size()));
     g_hash_table_insert(symtab, "rsaw", ssi_def_func(
-        __force_cast_from_func1(gen_rsaw), 1));
+        __force_cast_from_func1(gen_rsaw),
+        __force_cast_from_bfunc1(gen_rsaw_block), 1,
+        gen_storage_size()));
     g_hash_table_insert(symtab, "triangle", ssi_def_func(
-        __force_cast_from_func1(gen_triangle), 1));
+        __force_cast_from_func1(gen_triangle),
+        __force_cast_from_bfunc1(gen_triangle_block), 1,
+        gen_storage_size()));
     g_hash_table_insert(symtab, "pulse", ssi_def_func(
-        __force_cast_from_func1(gen_pulse), 1));
+        __force_cast_from_func1(gen_pulse),
+        __force_cast_from_bfunc1(gen_pulse_block), 1,
+        gen_storage_size()));
     g_hash_table_insert(symtab, "square", ssi_def_func(
-        __force_cast_from_func1(gen_square), 1));
-    g_hash_table_insert(symtab, "whitenoise", ssi_def_func(
-        __force_cast_from_func0(gen_whitenoise), 0));
+        __force_cast_from_func1(gen_square),
+        __force_cast_from_bfunc1(gen_square_block), 1,
+        gen_storage_size()));
+    def = ssi_def_func(
+        __force_cast_from_func0(gen_whitenoise),
+        __force_cast_from_bfunc0(gen_whitenoise_block), 0,
+        gen_noise_storage_size());
+    def->init = gen_noise_init;
+    g_hash_table_insert(symtab, "whitenoise", def);
 
     /* Transformers */
     g_hash_table_insert(symtab, "chipify", ssi_def_func(
-        __force_cast_from_func1(tf_chipify), 1));
+        __force_cast_from_func1(tf_chipify),
+        __force_cast_from_bfunc1(tf_chipify_block), 1, 0));
 
     /* Mathematical operations */
     g_hash_table_insert(symtab, "add", ssi_def_func(
-        __force_cast_from_func2(tf_add), 2));
+        __force_cast_from_func2(tf_add),
+        __force_cast_from_bfunc2(tf_add_block), 2, 0));
     g_hash_table_insert(symtab, "sub", ssi_def_func(
-        __force_cast_from_func2(tf_sub), 2));
+        __force_cast_from_func2(tf_sub),
+        __force_cast_from_bfunc2(tf_sub_block), 2, 0));
     g_hash_table_insert(symtab, "mul", ssi_def_func(
-        __force_cast_from_func2(tf_mul), 2));
+        __force_cast_from_func2(tf_mul),
+        __force_cast_from_bfunc2(tf_mul_block), 2, 0));
     g_hash_table_insert(symtab, "div", ssi_def_func(
-        __force_cast_from_func2(tf_div), 2));
+        __force_cast_from_func2(tf_div),
+        __force_cast_from_bfunc2(tf_div_block), 2, 0));
     g_hash_table_insert(symtab, "min", ssi_def_func(
-        __force_cast_from_func2(tf_min), 2));
+        __force_cast_from_func2(tf_min),
+        __force_cast_from_bfunc2(tf_min_block), 2, 0));
     g_hash_table_insert(symtab, "max", ssi_def_func(
-        __force_cast_from_func2(tf_max), 2));
+        __force_cast_from_func2(tf_max),
+        __force_cast_from_bfunc2(tf_max_block), 2, 0));
     g_hash_table_insert(symtab, "abs", ssi_def_func(
-        __force_cast_from_func1(tf_abs), 1));
+        __force_cast_from_func1(tf_abs),
+        __force_cast_from_bfunc1(tf_abs_block), 1, 0));
     g_hash_table_insert(symtab, "clamp", ssi_def_func(
-        __force_cast_from_func2(tf_clamp), 2));
+        __force_cast_from_func2(tf_clamp),
+        __force_cast_from_bfunc2(tf_clamp_block), 2, 0));
     g_hash_table_insert(symtab, "floor", ssi_def_func(
-        __force_cast_from_func1(tf_floor), 1));
+        __force_cast_from_func1(tf_floor),
+        __force_cast_from_bfunc1(tf_floor_block), 1, 0));
     g_hash_table_insert(symtab, "ceil", ssi_def_func(
-        __force_cast_from_func1(tf_ceil), 1));
+        __force_cast_from_func1(tf_ceil),
+        __force_cast_from_bfunc1(tf_ceil_block), 1, 0));
 
     return;
 }
@@ -166,77 +519,30 @@ void soundscript_init()
 /* Destroy soundscript subsystem */
 void soundscript_shutdown()
 {
-    g_hash_table_destroy(gc_ht);
     g_hash_table_destroy(symtab);
     return;
 }
 
-/* Mark mod pointer as used */
-msynth_modifier soundscript_mark_use(msynth_modifier mod)
-{
-     /*
-     * A hashtable entry means the garbage collector
-     * will free this pointer, therefore we remove it,
-     * if the key was not there anyway, there is no problem.
-     */
-    g_hash_table_remove(gc_ht, mod);
-
-    return mod;
-}
-
-/* Mark mod pointer as unused */
-msynth_modifier soundscript_mark_no_use(msynth_modifier mod)
-{
-     /*
-     * Insert the mod as key and value to mark it
-     * for removal.
-     */
-     g_hash_table_insert(gc_ht, mod, mod);
-
-    return mod;
-}
-
-/* Destroy all unused pointers and clear GC */
-void soundscript_run_gc(void)
+/* Copy identifier into the parse region, valid until the line is parsed */
+char *soundscript_dup(char *str)
 {
-    GList *list, *iter;
-    msynth_modifier mod;
-
-    iter = list = g_hash_table_get_values(gc_ht);
-
-    /* While elements in iter, free and update */
-    while (iter) {
-        mod = g_list_nth_data(iter, 0);
-
-        /* Remove object */
-        synth_free_recursive(mod);
-
-        /* grab next item in iter */
-        iter = g_list_next(iter);
-    }
-
-    /* Clear GC table */
-    g_hash_table_remove_all(gc_ht);
-    g_list_free(list);
-
-    return;
+    assert(parse_region);
+    return region_strdup(parse_region, str);
 }
 
 /* -------- Soundscript Build Interface ---------- */
-/* The following functions are all garbage collected, use with caution */
+/* Nodes built while parsing are temporary, graphs must be accepted with
+ * opt_intern before the line is done. */
 
 /* Constant signal */
 msynth_modifier ssb_number(float num)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_CONSTANT;
     newmod->data.constant = num;
-    newmod->storage = NULL;
-
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -244,16 +550,14 @@ msynth_modifier ssb_number(float num)
 /* Variable reference */
 msynth_modifier ssb_variable(char *varname)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_VARIABLE;
-    newmod->data.varname = strdup(varname);
-    assert(newmod->data.varname);
-    newmod->storage = NULL;
-
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
+    newmod->data.variable.name = strdup(varname);
+    assert(newmod->data.variable.name);
+    newmod->data.variable.var = NULL;
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -261,19 +565,15 @@ msynth_modifier ssb_variable(char *varname)
 /* Add samples */
 msynth_modifier ssb_add(msynth_modifier a, msynth_modifier b)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE2;
     newmod->data.node2.func = tf_add;
+    newmod->data.node2.bfunc = tf_add_block;
     newmod->data.node2.a = a;
     newmod->data.node2.b = b;
-    newmod->storage = NULL;
-
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
-    soundscript_mark_use(a);
-    soundscript_mark_use(b);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -281,19 +581,15 @@ msynth_modifier ssb_add(msynth_modifier a, msynth_modifier b)
 /* Subtract samples */
 msynth_modifier ssb_sub(msynth_modifier a, msynth_modifier b)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE2;
     newmod->data.node2.func = tf_sub;
+    newmod->data.node2.bfunc = tf_sub_block;
     newmod->data.node2.a = a;
     newmod->data.node2.b = b;
-    newmod->storage = NULL;
-
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
-    soundscript_mark_use(a);
-    soundscript_mark_use(b);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -301,19 +597,15 @@ msynth_modifier ssb_sub(msynth_modifier a, msynth_modifier b)
 /* Multiply samples */
 msynth_modifier ssb_mul(msynth_modifier a, msynth_modifier b)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE2;
     newmod->data.node2.func = tf_mul;
+    newmod->data.node2.bfunc = tf_mul_block;
     newmod->data.node2.a = a;
     newmod->data.node2.b = b;
-    newmod->storage = NULL;
-
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
-    soundscript_mark_use(a);
-    soundscript_mark_use(b);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -321,19 +613,15 @@ msynth_modifier ssb_mul(msynth_modifier a, msynth_modifier b)
 /* Divide sample by sample */
 msynth_modifier ssb_div(msynth_modifier a, msynth_modifier b)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE2;
     newmod->data.node2.func = tf_div;
+    newmod->data.node2.bfunc = tf_div_block;
     newmod->data.node2.a = a;
     newmod->data.node2.b = b;
-    newmod->storage = NULL;
-
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
-    soundscript_mark_use(a);
-    soundscript_mark_use(b);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -341,19 +629,16 @@ msynth_modifier ssb_div(msynth_modifier a, msynth_modifier b)
 /* Delay sample by X */
 msynth_modifier ssb_delay(msynth_modifier in, int delay)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE1;
     newmod->data.node.func = tf_delay;
+    newmod->data.node.bfunc = tf_delay_block;
     newmod->data.node.in = in;
-    newmod->storage = NULL;
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
     ssb_set_delay(newmod, delay);
 
-    /* Update GC */
-    soundscript_mark_no_use(newmod);
-    soundscript_mark_use(in);
-
     return newmod;
 }
 
@@ -392,17 +677,18 @@ int ssb_can_func2(char *func_name)
 /* Function generating signal (such as whitenoise) */
 msynth_modifier ssb_func0(char *func_name)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    struct ss_func_def *def = g_hash_table_lookup(symtab, func_name);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE0;
-    newmod->data.node0.func =
-        __force_cast_to_func0(
-        ((struct ss_func_def*)g_hash_table_lookup(symtab, func_name))->func);
-    newmod->storage = NULL;
-
-    /* Update GC state */
-    soundscript_mark_no_use(newmod);
+    newmod->data.node0.func = __force_cast_to_func0(def->func);
+    newmod->data.node0.bfunc = __force_cast_to_bfunc0(def->bfunc);
+    if (def->storage)
+        synth_alloc_storage(newmod, def->storage);
+    if (def->init)
+        def->init(newmod->storage);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -410,19 +696,19 @@ msynth_modifier ssb_func0(char *func_name)
 /* Function call with a single input signal */
 msynth_modifier ssb_func1(char *func_name, msynth_modifier in)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    struct ss_func_def *def = g_hash_table_lookup(symtab, func_name);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE1;
     newmod->data.node.in = in;
-    newmod->data.node.func =
-        __force_cast_to_func1(
-        ((struct ss_func_def*)g_hash_table_lookup(symtab, func_name))->func);
-    newmod->storage = NULL;
-
-    /* Update GC state */
-    soundscript_mark_use(in);
-    soundscript_mark_no_use(newmod);
+    newmod->data.node.func = __force_cast_to_func1(def->func);
+    newmod->data.node.bfunc = __force_cast_to_bfunc1(def->bfunc);
+    if (def->storage)
+        synth_alloc_storage(newmod, def->storage);
+    if (def->init)
+        def->init(newmod->storage);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
@@ -431,25 +717,47 @@ msynth_modifier ssb_func1(char *func_name, msynth_modifier in)
 msynth_modifier ssb_func2(char *func_name, msynth_modifier a,
     msynth_modifier b)
 {
-    msynth_modifier newmod = malloc(sizeof(struct _msynth_modifier));
-    assert(newmod);
+    struct ss_func_def *def = g_hash_table_lookup(symtab, func_name);
+    msynth_modifier newmod = synth_alloc_modifier();
 
     newmod->type = MSMT_NODE2;
     newmod->data.node2.a = a;
     newmod->data.node2.b = b;
-    newmod->data.node2.func =
-        __force_cast_to_func2(
-        ((struct ss_func_def*)g_hash_table_lookup(symtab, func_name))->func);
-    newmod->storage = NULL;
-
-    /* Update GC state */
-    soundscript_mark_use(a);
-    soundscript_mark_use(b);
-    soundscript_mark_no_use(newmod);
+    newmod->data.node2.func = __force_cast_to_func2(def->func);
+    newmod->data.node2.bfunc = __force_cast_to_bfunc2(def->bfunc);
+    if (def->storage)
+        synth_alloc_storage(newmod, def->storage);
+    if (def->init)
+        def->init(newmod->storage);
+    newmod->refs = 1;
+    newmod->eval_samples = -1;
 
     return newmod;
 }
 
+/* Return the name of the function evaluating blocks with bfunc, NULL if
+ * it is not a built-in function
+ *
+ * Block functions of any arity may be passed, cast like the symbol table
+ * entries.
+ */
+const char *ssb_func_name(msynth_blockfunc bfunc)
+{
+    GHashTableIter iter;
+    gpointer name, value;
+
+    if (bfunc == tf_delay_block)
+        return "delay";
+
+    g_hash_table_iter_init(&iter, symtab);
+    while (g_hash_table_iter_next(&iter, &name, &value))
+        if (__force_cast_to_bfunc1(((struct ss_func_def *)value)->bfunc) ==
+                bfunc)
+            return name;
+
+    return NULL;
+}
+
 /* Check if node is delay */
 int ssb_is_delay(msynth_modifier mod)
 {
@@ -474,21 +782,14 @@ int ssb_get_delay(msynth_modifier mod)
 void ssb_set_delay(msynth_modifier mod, int delay)
 {
     tf_delay_info di;
-    float *history;
-    int i;
 
-    free(mod->storage);
-    mod->storage = malloc(sizeof(struct _tf_delay_info) +
-        sizeof(float) * delay);
-    assert(mod->storage);
+    /* Releases the previous line, see synth_free_storage */
+    synth_alloc_storage(mod, sizeof(struct _tf_delay_info));
 
+    /* A line of its own, until shared with other taps by opt_intern */
     di = (tf_delay_info)mod->storage;
-    history = (float*)(di + 1);
     di->delay = delay;
-    di->pos = 0;
-
-    for (i = 0; i < delay; i++)
-        history[i] = 0.0f;
+    di->line = delay ? tf_delay_line_new(delay) : NULL;
 
     return;
 }
@@ -508,48 +809,130 @@ static soundscript_var _ssv_alloc_var(void)
     new->recursive_next = 0.;
     new->mark = 0;
 
+    new->block = calloc(MSYNTH_BLOCK, sizeof(float));
+    assert(new->block);
+
+    new->deps = g_ptr_array_new();
+    new->users = g_ptr_array_new();
+    new->order = 0;
+    new->pending = NULL;
+    new->name = NULL;
+
     return new;
 }
 
-/* Set var <vname> to <mod> */
-void ssv_set_var(char *vname, msynth_modifier mod)
+/* Free variable structure, its graph must have been released */
+static void _ssv_free_var(soundscript_var var)
 {
-    soundscript_var new; 
+    free(var->block);
+    g_ptr_array_free(var->deps, TRUE);
+    g_ptr_array_free(var->users, TRUE);
+    free(var);
+
+    return;
+}
+
+/* Assign <mod> to var <vname> and update the dependency index
+ *
+ * The graph is bound and its references are recorded in both directions
+ * (deps and users). Afterwards the evaluation order is repaired, this only
+ * touches variables between the old positions of a new edge.
+ * NOTE: The assignment must not cause a cycle, see ssv_speculate_cycle.
+ */
+static void _ssv_assign(char *vname, msynth_modifier mod, int recursive)
+{
+    soundscript_var new, v;
+    int i;
+
+    if (pending_tab) {
+        _ssv_assign_pending(vname, mod, recursive);
+        return;
+    }
 
     new = g_hash_table_lookup(vartab, vname);
 
     /* Replace existing var or allocate if necessary */
     if (new) {
         synth_free_recursive(new->vargraph);
+        _ssv_unlink_deps(new);
     } else {
         new = _ssv_alloc_var();
+        new->order = var_order->len;
+        g_ptr_array_add(var_order, new);
+        vname = strdup(vname);
+        assert(vname);
+        new->name = vname;
         g_hash_table_insert(vartab, vname, new);
     }
 
     new->vargraph = mod;
-    new->recursive = 0;
+    new->recursive = recursive;
+    _ssv_bind_graph(new, mod);
+
+    /* Normal variables read must be evaluated first */
+    for (i = 0; i < new->deps->len; i++) {
+        v = g_ptr_array_index(new->deps, i);
+        if (!v->recursive && v->order > new->order)
+            _ssv_reorder(v, new);
+    }
+
+    /* And a normal variable must be evaluated before its users */
+    if (!recursive) {
+        for (i = 0; i < new->users->len; i++) {
+            v = g_ptr_array_index(new->users, i);
+            if (v->order < new->order)
+                _ssv_reorder(new, v);
+        }
+    }
 
     return;
 }
 
-/* Set var <vname> to recursive <mod> */
-void ssv_set_var_recursive(char *vname, msynth_modifier mod)
+/* Record the assignment of <mod> to var <vname> while loading a script
+ *
+ * The pending variable is unbound, it takes the place of the installed
+ * variable of the same name (if any) once the script is installed.
+ */
+static void _ssv_assign_pending(char *vname, msynth_modifier mod,
+    int recursive)
 {
-    soundscript_var new; 
+    soundscript_var pending, v;
 
-    new = g_hash_table_lookup(vartab, vname);
+    pending = g_hash_table_lookup(pending_tab, vname);
 
-    /* Replace existing var or allocate if necessary */
-    if (new) {
-        synth_free_recursive(new->vargraph);
+    if (pending) {
+        synth_free_recursive(pending->vargraph);
     } else {
-        new = _ssv_alloc_var();
-        g_hash_table_insert(vartab, vname, new);
+        pending = _ssv_alloc_var();
+        pending->order = -1;
+        vname = strdup(vname);
+        assert(vname);
+        pending->name = vname;
+        g_hash_table_insert(pending_tab, vname, pending);
+        g_ptr_array_add(pending_names, vname);
+
+        v = g_hash_table_lookup(vartab, vname);
+        if (v)
+            v->pending = pending;
     }
 
-    new->vargraph = mod;
-    new->recursive = 1;
+    pending->vargraph = mod;
+    pending->recursive = recursive;
+
+    return;
+}
 
+/* Set var <vname> to <mod> */
+void ssv_set_var(char *vname, msynth_modifier mod)
+{
+    _ssv_assign(vname, mod, 0);
+    return;
+}
+
+/* Set var <vname> to recursive <mod> */
+void ssv_set_var_recursive(char *vname, msynth_modifier mod)
+{
+    _ssv_assign(vname, mod, 1);
     return;
 }
 
@@ -561,13 +944,32 @@ float ssv_get_var_eval(char *vname)
     return v->last_eval;
 }
 
-/* Return variable by name */
-soundscript_var ssv_get_var(char *vname)
+/* Return the block evaluation of var <vname> */
+float *ssv_get_var_block(char *vname)
 {
     soundscript_var v = g_hash_table_lookup(vartab, vname);
+    assert(v);
+    return v->block;
+}
+
+/* Return variable by name, pending assignments first */
+soundscript_var ssv_get_var(char *vname)
+{
+    soundscript_var v = NULL;
+
+    if (pending_tab)
+        v = g_hash_table_lookup(pending_tab, vname);
+    if (!v)
+        v = g_hash_table_lookup(vartab, vname);
     return v;
 }
 
+/* Return the name of a variable */
+const char *ssv_get_name(soundscript_var var)
+{
+    return var->name;
+}
+
 /* Setup dummy variable
  *
  * This function is used to support recursive definitions.
@@ -581,51 +983,16 @@ soundscript_var ssv_get_var(char *vname)
  */
 void ssv_set_dummy(char *vname)
 {
-    if (g_hash_table_lookup(vartab, vname) == NULL)
-        ssv_set_var(vname, soundscript_mark_use(ssb_number(0.f)));
+    if (ssv_get_var(vname) == NULL)
+        ssv_set_var(vname, opt_intern(ssb_number(0.f)));
 
     return;
 }
 
-/* Compare two graphs' variable usage
- *
- * Purpose: This function is a helper used to qsort()
- *          the variable evaluation order.
- *
- * Returns:
- *      -1 g1 is used by g2 and must be evaluted earlier than g1
- *       0 g1 and g2 form a circular dependency or don't reference each other
- *       1 g1 uses g2 and must be evaluated later.
- */
-static int _compare_graphs(const void *g1, const void *g2)
-{
-    int r;
-    soundscript_var
-        mod1 = *(soundscript_var*)g1,
-        mod2 = *(soundscript_var*)g2;
-
-    r = ssv_makes_use_of(mod1, mod2);
-    if (r) {
-        /* Circular/Mutual use, order cannot be established */
-        if (r == SSV_USAGE_CIRCULAR)
-            return 0;
-
-        /* Non-circular usage, g1 only uses g2, evaluate later */
-        else
-            return 1;
-    }
-
-    /* Perhaps g2 uses g1, evaluate earlier */
-    if (ssv_makes_use_of(mod2, mod1) == SSV_USAGE_ONEWAY)
-        return -1;
-
-    /* No usage at all, order does not matter */
-    return 0;
-}
-
 /* This function checks the usage of a mod2 by mod1
  *
  * mod2 may be NULL to check purely check for cycles in the graph of mod1.
+ * Only the variables reachable from mod1 are visited.
  *
  * returns:
  *      SSV_USAGE_NONE:     mod1 does not depend on mod2.
@@ -635,38 +1002,22 @@ static int _compare_graphs(const void *g1, const void *g2)
  */
 int ssv_makes_use_of(soundscript_var mod1, soundscript_var mod2)
 {
+    GPtrArray *visited = g_ptr_array_new();
     int usage = 0x0;
-    GList *list, *iter;
-    soundscript_var v;
 
     /* Mark are variables used (directly or indirectly) by mod1 */
-    ssv_recursively_mark_vars(mod1);
-
-    iter = list = g_hash_table_get_values(vartab);
-
-    /* Check all variables and unmark them */
-    while (iter) {
-        v = (soundscript_var)g_list_nth_data(iter, 0);
-
-        if (v->mark & 0x2) {
-            /* Non circular usage */
-            if (v == mod2)
-                usage |= 1;
-
-            /* Circular usage */
-            if (v == mod1)
-                usage |= 2;
-        }
+    _ssv_mark_reachable(mod1, visited);
 
-        /* Unmark variable */
-        v->mark &= ~0x3;
+    /* Non circular usage */
+    if (mod2 && (mod2->mark & 0x2))
+        usage |= 1;
 
-        /* grab next item in iter */
-        iter = g_list_next(iter);
-    }
+    /* Circular usage */
+    if (mod1->mark & 0x2)
+        usage |= 2;
 
-    /* Free iterated list */
-    g_list_free(list);
+    _ssv_unmark(visited, 0x3);
+    g_ptr_array_free(visited, TRUE);
 
     if (usage > 1)
         return SSV_USAGE_CIRCULAR;
@@ -679,15 +1030,25 @@ int ssv_makes_use_of(soundscript_var mod1, soundscript_var mod2)
 
 /* Check if assigning graph to var vname would cause a cycle
  *
- * A value of 1 will mean the assignment causes a cycle.
+ * A value of 1 will mean the assignment causes a cycle, that is when
+ * vname eventually is read by one of the normal variables read by graph.
+ * As the evaluation order puts every normal variable before its users,
+ * only users of vname ordered before the last variable read by graph
+ * need to be searched.
  * NOTE: Since cycles cannot occur with recursive variables
  *       this function assumes the vname is about to be
  *       non-recursively assigned.
+ * NOTE2: Scripts being loaded are checked for cycles as a whole, once
+ *        all lines are parsed, see _ss_check_pending.
  */
 int ssv_speculate_cycle(char *vname, msynth_modifier graph)
 {
-    soundscript_var var;
-    int usage;
+    GPtrArray *deps, *visited;
+    soundscript_var var, dep;
+    int i, ub = -1, cycle = 0;
+
+    if (pending_tab)
+        return 0;
 
     var = g_hash_table_lookup(vartab, vname);
     
@@ -695,21 +1056,32 @@ int ssv_speculate_cycle(char *vname, msynth_modifier graph)
     if (!var)
         return 0;
 
-    /* Let's replace the current variable with our speculation variable
-     * NOTE: Assign non recursively, as doing otherwise would defeat the purpose
-     * of this function, recursive variables cannot form cycles.
-     */
-    g_hash_table_insert(vartab, vname, NULL);
-    ssv_set_var(vname, graph);
+    deps = g_ptr_array_new();
+    visited = g_ptr_array_new();
+    _ssv_collect_graph_vars(graph, deps);
+
+    /* Mark the targets of the search */
+    for (i = 0; i < deps->len; i++) {
+        dep = g_ptr_array_index(deps, i);
+        if (dep == var)
+            cycle = 1;
+        if (dep->order > ub)
+            ub = dep->order;
+        dep->mark |= 0x2;
+    }
 
-    /* Compute cycle */
-    usage = ssv_makes_use_of(ssv_get_var(vname), NULL);
+    if (!cycle) {
+        var->mark |= 0x1;
+        g_ptr_array_add(visited, var);
+        cycle = _ssv_search_users(var, ub, visited);
+    }
 
-    /* Restore old variable */
-    free(ssv_get_var(vname));
-    g_hash_table_insert(vartab, vname, var);
+    _ssv_unmark(deps, 0x2);
+    _ssv_unmark(visited, 0x1);
+    g_ptr_array_free(deps, TRUE);
+    g_ptr_array_free(visited, TRUE);
 
-    return usage == SSV_USAGE_CIRCULAR;
+    return cycle;
 }
 
 /* Verify a soundgraph is recursive valid
@@ -750,7 +1122,7 @@ static int _ssv_validate_recursion(msynth_modifier mod, int can_reference)
 
     switch(mod->type) {
         case MSMT_VARIABLE:
-            var = ssv_get_var(mod->data.varname);
+            var = ssv_get_var(mod->data.variable.name);
             assert(var);
 
             if (var->recursive)
@@ -784,6 +1156,9 @@ static int _ssv_validate_recursion(msynth_modifier mod, int can_reference)
  */
 void ssv_recursively_mark_vars(soundscript_var var)
 {
+    soundscript_var dep;
+    int i;
+
     /* This variable was processed already */
     if (var->mark & 0x1)
         return;
@@ -791,38 +1166,70 @@ void ssv_recursively_mark_vars(soundscript_var var)
     /* Mark as touched (prevents infinite recursion) */
     var->mark |= 0x1;
 
-    _ssv_recursively_mark_graphs(var->vargraph);
+    for (i = 0; i < var->deps->len; i++) {
+        dep = g_ptr_array_index(var->deps, i);
+
+        /* Recursive variables are special, they can never cause
+         * infinite evaluation, and are therefore ignored in cycle
+         * checking. All their references are delayed.
+         */
+        if (!dep->recursive) {
+            /* This is the actual usage mark used for cycle detection */
+            dep->mark |= 0x2;
+            ssv_recursively_mark_vars(dep);
+        }
+    }
+
     return;
 }
 
-/* Recursively mark variables used in sound graph */
-static void _ssv_recursively_mark_graphs(msynth_modifier mod)
+/* Mark normal variables read by var, directly or indirectly
+ *
+ * Like ssv_recursively_mark_vars, but every variable marked is appended
+ * to visited, so the marks can be cleared without scanning all variables.
+ */
+static void _ssv_mark_reachable(soundscript_var var, GPtrArray *visited)
+{
+    soundscript_var dep;
+    int i;
+
+    if (var->mark & 0x1)
+        return;
+    var->mark |= 0x1;
+    g_ptr_array_add(visited, var);
+
+    for (i = 0; i < var->deps->len; i++) {
+        dep = g_ptr_array_index(var->deps, i);
+        if (!dep->recursive) {
+            dep->mark |= 0x2;
+            _ssv_mark_reachable(dep, visited);
+        }
+    }
+
+    return;
+}
+
+/* Collect the normal variables read by an unbound graph */
+static void _ssv_collect_graph_vars(msynth_modifier mod, GPtrArray *vars)
 {
     soundscript_var var;
 
     switch(mod->type) {
         case MSMT_VARIABLE:
-            var = ssv_get_var(mod->data.varname);
+            var = ssv_get_var(mod->data.variable.name);
             assert(var);
 
-            /* Recursive variables are special, they can never cause
-             * infinite evaluation, and are therefore ignored in cycle
-             * checking. All their references are delayed.
-             */
-            if (!var->recursive) {
-                /* This is the actual usage mark used for cycle detection */
-                var->mark |= 0x2;
-                ssv_recursively_mark_vars(var);
-            }
+            if (!var->recursive)
+                g_ptr_array_add(vars, var);
             break;
 
         case MSMT_NODE1:
-            _ssv_recursively_mark_graphs(mod->data.node.in);
+            _ssv_collect_graph_vars(mod->data.node.in, vars);
             break;
 
         case MSMT_NODE2:
-            _ssv_recursively_mark_graphs(mod->data.node2.a);
-            _ssv_recursively_mark_graphs(mod->data.node2.b);
+            _ssv_collect_graph_vars(mod->data.node2.a, vars);
+            _ssv_collect_graph_vars(mod->data.node2.b, vars);
             break;
 
         default:;
@@ -831,87 +1238,83 @@ static void _ssv_recursively_mark_graphs(msynth_modifier mod)
     return;
 }
 
-/* Mark all immediately reached vars */
-void _ssv_recursively_mark_immediate_graphs(msynth_modifier mod)
+/* Search the normal users of var ordered before ub for a 0x2 marked one
+ *
+ * Visited variables are 0x1 marked and appended to visited.
+ */
+static int _ssv_search_users(soundscript_var var, int ub, GPtrArray *visited)
 {
-    soundscript_var var;
-
-    switch(mod->type) {
-        case MSMT_VARIABLE:
-            var = ssv_get_var(mod->data.varname);
-            assert(var);
+    soundscript_var user;
+    int i;
 
-            /* This is the actual usage mark used for cycle detection */
-            var->mark |= 0x4;
-            break;
+    for (i = 0; i < var->users->len; i++) {
+        user = g_ptr_array_index(var->users, i);
 
-        case MSMT_NODE1:
-            _ssv_recursively_mark_graphs(mod->data.node.in);
-            break;
+        if (user->mark & 0x2)
+            return 1;
 
-        case MSMT_NODE2:
-            _ssv_recursively_mark_graphs(mod->data.node2.a);
-            _ssv_recursively_mark_graphs(mod->data.node2.b);
-            break;
+        if ((user->mark & 0x1) || user->recursive || user->order > ub)
+            continue;
 
-        default:;
+        user->mark |= 0x1;
+        g_ptr_array_add(visited, user);
+        if (_ssv_search_users(user, ub, visited))
+            return 1;
     }
 
+    return 0;
+}
+
+/* Clear marks of the visited variables */
+static void _ssv_unmark(GPtrArray *visited, unsigned int clear)
+{
+    int i;
+
+    for (i = 0; i < visited->len; i++)
+        ((soundscript_var)g_ptr_array_index(visited, i))->mark &= ~clear;
+
     return;
 }
 
 /* Recursively find all variables in a cycle
  *
- * XXX: There are probably more efficient algorithms around to implement this,
- *      it might be worth investigating various cycle detection algorithms.
+ * Every variable read by cvar is checked for reaching back to cvar, using
+ * the dependency index. Only the variables reachable from cvar are visited.
  *
- * This function first marks all variables reachable from a given variable
- * afterwards eliminating all variables not looping back to this variable.
- *
- * This function returns nothing, but leaves the variables mark members intact
- * after completion.
+ * This function returns nothing, but sets mark bit 0x8 of the variables
+ * read by cvar taking part in the cycle.
  *
  * NOTE: This function assumes there is an actual cycle.
  *
- * NOTE: This function requires all mark members to be 0 to return the correct
- *       results. Failure to do so will lead to incorrect results, although will
- *       not crash the program.
+ * NOTE: This function requires the first 2 mark bits to be 0 to return the
+ *       correct results. Failure to do so will lead to incorrect results,
+ *       although will not crash the program.
  */
 void ssv_mark_cycle_vars(soundscript_var cvar)
 {
-    GList *list, *iter;
+    GPtrArray *visited = g_ptr_array_new();
     soundscript_var v;
+    int i;
 
-    /* First begin with marking all vars reachable from 'var' */
-    _ssv_recursively_mark_immediate_graphs(cvar->vargraph);
-
-    /* Now check all vars partaking in the cycle */
-    iter = list = g_hash_table_get_values(vartab);
-
-    /* Convert all touched marks to persistent test marks. */
-    while (iter) {
-        v = (soundscript_var)g_list_nth_data(iter, 0);
-
-        /* Only check required vars */
-        if (v->mark & 0x4) {
-            /* Mark v to check if it links back to cvar */
-            ssv_recursively_mark_vars(v);
+    for (i = 0; i < cvar->deps->len; i++) {
+        v = g_ptr_array_index(cvar->deps, i);
 
-            /* Did we reach cvar */
-            if (cvar->mark & 0x2) {
-                /* Set cycle member flag */
-                v->mark |= 0x8;
-            }
+        /* Mark v to check if it links back to cvar */
+        v->mark |= 0x2;
+        g_ptr_array_add(visited, v);
+        _ssv_mark_reachable(v, visited);
 
-            ssv_clear_marks(0x3);
+        /* Did we reach cvar */
+        if (cvar->mark & 0x2) {
+            /* Set cycle member flag */
+            v->mark |= 0x8;
         }
 
-        /* grab next item in iter */
-        iter = g_list_next(iter);
+        _ssv_unmark(visited, 0x3);
+        g_ptr_array_set_size(visited, 0);
     }
 
-    /* Free iterated list */
-    g_list_free(list);
+    g_ptr_array_free(visited, TRUE);
 
     return;
 }
@@ -942,47 +1345,353 @@ void ssv_clear_marks(unsigned int clear)
     g_list_free(list);
 }
 
-/* Regroup variables */
-void ssv_regroup(void)
+/* Bind variable references in graph to their variables
+ *
+ * Variables are never freed, so the evaluation can use the bound
+ * variables directly instead of looking them up by name. All referenced
+ * variables are added to the dependencies of var, and var to their users.
+ */
+static void _ssv_bind_graph(soundscript_var var, msynth_modifier mod)
+{
+    switch(mod->type) {
+        case MSMT_VARIABLE:
+            mod->data.variable.var = ssv_get_var(mod->data.variable.name);
+            assert(mod->data.variable.var);
+            g_ptr_array_add(var->deps, mod->data.variable.var);
+            g_ptr_array_add(mod->data.variable.var->users, var);
+            break;
+
+        case MSMT_NODE1:
+            _ssv_bind_graph(var, mod->data.node.in);
+            break;
+
+        case MSMT_NODE2:
+            _ssv_bind_graph(var, mod->data.node2.a);
+            _ssv_bind_graph(var, mod->data.node2.b);
+            break;
+
+        default:;
+    }
+
+    return;
+}
+
+/* Remove var from the users of the variables it reads */
+static void _ssv_unlink_deps(soundscript_var var)
+{
+    soundscript_var dep;
+    int i;
+
+    for (i = 0; i < var->deps->len; i++) {
+        dep = g_ptr_array_index(var->deps, i);
+        g_ptr_array_remove_fast(dep->users, var);
+    }
+    g_ptr_array_set_size(var->deps, 0);
+
+    return;
+}
+
+/* Collect variables that must follow var and are ordered before ub
+ *
+ * NOTE: This function uses mark bit 0x40 (collected).
+ */
+static void _ssv_collect_users(soundscript_var var, int ub, GPtrArray *found)
+{
+    soundscript_var user;
+    int i;
+
+    var->mark |= 0x40;
+    g_ptr_array_add(found, var);
+
+    /* Reads of recursive variables impose no order */
+    if (var->recursive)
+        return;
+
+    for (i = 0; i < var->users->len; i++) {
+        user = g_ptr_array_index(var->users, i);
+        if (!(user->mark & 0x40) && user->order < ub)
+            _ssv_collect_users(user, ub, found);
+    }
+
+    return;
+}
+
+/* Collect variables that must precede var and are ordered after lb
+ *
+ * NOTE: This function uses mark bit 0x40 (collected).
+ */
+static void _ssv_collect_deps(soundscript_var var, int lb, GPtrArray *found)
 {
-    int i = 0, j;
-    GList *iter, *list;
+    soundscript_var dep;
+    int i;
+
+    var->mark |= 0x40;
+    g_ptr_array_add(found, var);
+
+    for (i = 0; i < var->deps->len; i++) {
+        dep = g_ptr_array_index(var->deps, i);
+        if (!dep->recursive && !(dep->mark & 0x40) && dep->order > lb)
+            _ssv_collect_deps(dep, lb, found);
+    }
+
+    return;
+}
+
+/* Compare variables by evaluation order */
+static int _ssv_compare_order(const void *a, const void *b)
+{
+    return (*(soundscript_var *)a)->order - (*(soundscript_var *)b)->order;
+}
+
+/* Compare evaluation order positions */
+static int _ssv_compare_int(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+/* Restore the evaluation order after var was made to read dep
+ *
+ * Dynamic topological ordering (Pearce and Kelly): when dep is ordered
+ * after var, only the variables in between that must follow var or must
+ * precede dep are moved. They are reassigned the positions they already
+ * occupied, with those preceding dep first, keeping their relative order.
+ */
+static void _ssv_reorder(soundscript_var dep, soundscript_var var)
+{
+    GPtrArray *later, *earlier;
     soundscript_var v;
+    int i, n, *pos;
 
-    free(eval_list);
+    later = g_ptr_array_new();
+    earlier = g_ptr_array_new();
 
-    /* j will be used to place all recursive variables at the end of the list */
-    j = g_hash_table_size(vartab);
-    eval_list = calloc(j, sizeof(soundscript_var));
+    _ssv_collect_users(var, dep->order, later);
+    _ssv_collect_deps(dep, var->order, earlier);
 
-    iter = list = g_hash_table_get_values(vartab);
+    qsort(later->pdata, later->len, sizeof(gpointer), _ssv_compare_order);
+    qsort(earlier->pdata, earlier->len, sizeof(gpointer),
+        _ssv_compare_order);
 
-    /* Fetch all variables and store them in evaluation array */
-    while (iter) {
-        v = (soundscript_var)g_list_nth_data(iter, 0);
+    /* Gather the positions, then hand them out in the new order */
+    n = earlier->len + later->len;
+    pos = malloc(n * sizeof(int));
+    assert(pos);
 
-        /* Store var in array */
-        if (v->recursive)
-            eval_list[--j] = v;
+    for (i = 0; i < earlier->len; i++)
+        pos[i] = ((soundscript_var)g_ptr_array_index(earlier, i))->order;
+    for (i = 0; i < later->len; i++)
+        pos[earlier->len + i] =
+            ((soundscript_var)g_ptr_array_index(later, i))->order;
+    qsort(pos, n, sizeof(int), _ssv_compare_int);
+
+    for (i = 0; i < n; i++) {
+        if (i < earlier->len)
+            v = g_ptr_array_index(earlier, i);
         else
+            v = g_ptr_array_index(later, i - earlier->len);
+
+        v->order = pos[i];
+        v->mark &= ~0x40;
+        g_ptr_array_index(var_order, pos[i]) = v;
+    }
+
+    free(pos);
+    g_ptr_array_free(later, TRUE);
+    g_ptr_array_free(earlier, TRUE);
+
+    return;
+}
+
+/* Search the normal variables read by var for a cycle, with the pending
+ * assignments in effect
+ *
+ * Returns 1 if var reaches a variable still being searched. Visited
+ * variables are appended to visited.
+ * NOTE: This function uses mark bits 0x100 (being searched) and 0x200
+ *       (searched).
+ */
+static int _ssv_pending_cycle(soundscript_var var, GPtrArray *visited)
+{
+    GPtrArray *deps;
+    soundscript_var dep;
+    int i, cycle = 0;
+
+    if (var->mark & 0x100)
+        return 1;
+    if (var->mark & 0x200)
+        return 0;
+
+    var->mark |= 0x100;
+    g_ptr_array_add(visited, var);
+
+    /* Pending graphs are not bound yet */
+    if (var->order < 0) {
+        deps = g_ptr_array_new();
+        _ssv_collect_graph_vars(var->vargraph, deps);
+    } else {
+        deps = var->deps;
+    }
+
+    for (i = 0; i < deps->len && !cycle; i++) {
+        dep = g_ptr_array_index(deps, i);
+        if (dep->pending)
+            dep = dep->pending;
+        if (!dep->recursive)
+            cycle = _ssv_pending_cycle(dep, visited);
+    }
+
+    if (deps != var->deps)
+        g_ptr_array_free(deps, TRUE);
+    var->mark = (var->mark & ~0x100) | 0x200;
+
+    return cycle;
+}
+
+/* Place var in order after the normal variables it reads
+ *
+ * NOTE: This function uses mark bit 0x100 (placed).
+ */
+static void _ssv_sort_visit(soundscript_var var, GPtrArray *order)
+{
+    soundscript_var dep;
+    int i;
+
+    if (var->mark & 0x100)
+        return;
+    var->mark |= 0x100;
+
+    for (i = 0; i < var->deps->len; i++) {
+        dep = g_ptr_array_index(var->deps, i);
+        if (!dep->recursive)
+            _ssv_sort_visit(dep, order);
+    }
+
+    var->order = order->len;
+    g_ptr_array_add(order, var);
+
+    return;
+}
+
+/* Rebuild the evaluation order at once
+ *
+ * Used when many assignments are installed together, which may leave the
+ * order off in many places. Takes time linear in the amount of variables
+ * and references, the previous order is kept where it holds.
+ */
+static void _ssv_sort(void)
+{
+    GPtrArray *order;
+    int i;
+
+    order = g_ptr_array_sized_new(var_order->len);
+    for (i = 0; i < var_order->len; i++)
+        _ssv_sort_visit(g_ptr_array_index(var_order, i), order);
+    _ssv_unmark(order, 0x100);
+
+    g_ptr_array_free(var_order, TRUE);
+    var_order = order;
+
+    return;
+}
+
+/* Regroup variables
+ *
+ * Lists the variables in evaluation order, every variable is evaluated
+ * after the variables it reads. The order and the dependencies are kept
+ * up to date by each assignment, so this only has to lower the new tape.
+ */
+void ssv_regroup(void)
+{
+    int i = 0, j, k, size;
+    soundscript_var v, *tail;
+    synth_tape tape;
+
+    free(eval_list);
+
+    size = g_hash_table_size(vartab);
+    eval_list = calloc(size, sizeof(soundscript_var));
+    assert(eval_list || !size);
+
+    /* Normal variables, in the order maintained on assignment */
+    for (j = 0; j < var_order->len; j++) {
+        v = g_ptr_array_index(var_order, j);
+        if (!v->recursive)
             eval_list[i++] = v;
+    }
 
-        /* grab next item in iter */
-        iter = g_list_next(iter);
+    /* Recursive variables only depend on normal variables, so they can
+     * be placed at the end of the list in any order.
+     */
+    eval_recursive = i;
+    for (j = 0, k = i; j < var_order->len; j++) {
+        v = g_ptr_array_index(var_order, j);
+        if (v->recursive)
+            eval_list[k++] = v;
     }
 
-    g_list_free(list);
+    /* Move all variables that can be evaluated a block at a time to the
+     * front. Partitioning is stable, so the dependency order is kept.
+     */
+    tail = calloc(i, sizeof(soundscript_var));
+    assert(tail || !i);
+    eval_block = k = 0;
+    for (j = 0; j < i; j++) {
+        v = eval_list[j];
+        if (_ssv_needs_sample_eval(v))
+            tail[k++] = v;
+        else
+            eval_list[eval_block++] = v;
+    }
+    memcpy(eval_list + eval_block, tail, sizeof(soundscript_var) * k);
+    free(tail);
+    ssv_clear_marks(0x30);
 
-    /* Store the first recursive entry in a global var */
-    eval_recursive = j;
+    /* Lower all variables into a fresh tape and publish it, the synth
+     * thread picks it up at the start of its next period.
+     */
+    tape = tape_lower(eval_list, size, eval_block);
+    tape = __atomic_exchange_n(&eval_tape, tape, __ATOMIC_SEQ_CST);
+
+    /* Free the old tape (and retired graphs) once no longer in use */
+    synth_synchronize();
+    tape_free(tape);
 
-    /* Now sort array using quicksort based on dependencies */
-    qsort(eval_list, i,
-        sizeof(soundscript_var), _compare_graphs);
+    /* The new graphs are evaluated from now on */
+    opt_seal();
 
     return;
 }
 
+/* Check if a variable must be evaluated sample by sample
+ *
+ * Recursive variables feed back into the graph with a delay of a single
+ * sample, so they, and everything reading them, cannot be computed
+ * a block at a time.
+ *
+ * NOTE: This function uses mark bits 0x10 (visited) and 0x20 (result),
+ *       clear them using ssv_clear_marks(0x30) afterwards.
+ */
+static int _ssv_needs_sample_eval(soundscript_var var)
+{
+    int i;
+
+    if (var->mark & 0x10)
+        return (var->mark & 0x20) != 0;
+
+    /* Set both bits first, this terminates recursive references */
+    var->mark |= 0x30;
+
+    if (var->recursive)
+        return 1;
+
+    for (i = 0; i < var->deps->len; i++)
+        if (_ssv_needs_sample_eval(g_ptr_array_index(var->deps, i)))
+            return 1;
+
+    var->mark &= ~0x20;
+    return 0;
+}
+
 /* Evaluate variables */
 void ssv_eval(struct sampleclock sc)
 {
@@ -1001,6 +1710,7 @@ void ssv_eval(struct sampleclock sc)
     for (; i < size; i++) {
         v = eval_list[i];
         v->recursive_next = synth_eval(v->vargraph, sc);
+        v->recursive_next = SYNTH_FLUSH(v->recursive_next);
     }
 
     /* Store recursive new entries */
@@ -1012,3 +1722,27 @@ void ssv_eval(struct sampleclock sc)
     return;
 }
 
+
+/* Evaluate a block of variables
+ *
+ * Block counterpart of ssv_eval, evaluates 'frames' (at most MSYNTH_BLOCK)
+ * samples starting at sample clock sc. The results are available through
+ * the block member of each variable.
+ *
+ * The output is identical to calling ssv_eval for each frame.
+ */
+void ssv_eval_block(struct sampleclock sc, int frames)
+{
+    tape_run(ssv_get_tape(), sc, frames);
+    return;
+}
+
+/* Return the most recently published tape
+ *
+ * The synth thread fetches the tape once per period, it stays valid until
+ * the synth thread reports a quiescent state (see synth_synchronize).
+ */
+struct _synth_tape *ssv_get_tape(void)
+{
+    return __atomic_load_n(&eval_tape, __ATOMIC_SEQ_CST);
+}
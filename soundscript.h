@@ -2,19 +2,16 @@
 
 int yyparse(void);
 void soundscript_parse(char *line);
+int soundscript_load(char *path);
+void soundscript_queue_load(char *path);
 
 /* Global init/shutdown */
 void soundscript_init();
-gpointer ssi_def_func(void *func, int args);
+gpointer ssi_def_func(void *func, void *bfunc, int args, size_t storage);
 void soundscript_shutdown();
 
-/* Soundscript GC */
-msynth_modifier soundscript_mark_use(msynth_modifier mod);
-msynth_modifier soundscript_mark_no_use(msynth_modifier mod);
-void soundscript_run_gc(void);
-
-/* Soundscript lexer/string GC */
-void soundscript_clear_dups();
+/* Soundscript lexer identifiers */
+char *soundscript_dup(char *str);
 
 /* Soundscript build interface */
 msynth_modifier ssb_number(float num);
@@ -31,6 +28,7 @@ msynth_modifier ssb_func0(char *func_name);
 msynth_modifier ssb_func1(char *func_name, msynth_modifier in);
 msynth_modifier ssb_func2(char *func_name, msynth_modifier a,
     msynth_modifier b);
+const char *ssb_func_name(msynth_blockfunc bfunc);
 int ssb_is_delay(msynth_modifier mod);
 int ssb_get_delay(msynth_modifier mod);
 void ssb_set_delay(msynth_modifier mod, int delay);
@@ -41,8 +39,24 @@ typedef struct _soundscript_var {
     float
         last_eval,
         recursive_next;
+    float *block;
     int recursive;
     int mark;
+
+    /* Variables read by vargraph and variables reading this one,
+     * updated on every assignment
+     */
+    GPtrArray *deps;
+    GPtrArray *users;
+
+    /* Position in the evaluation order, -1 while pending */
+    int order;
+
+    /* Assignment pending while a script is loaded, NULL otherwise */
+    struct _soundscript_var *pending;
+
+    /* Name, the key of the variable in the variable table */
+    const char *name;
 } *soundscript_var;
 
 /* Sound graph usage dependencies */
@@ -54,8 +68,10 @@ typedef struct _soundscript_var {
 void ssv_set_var(char *vname, msynth_modifier mod);
 void ssv_set_var_recursive(char *vname, msynth_modifier mod);
 float ssv_get_var_eval(char *vname);
+float *ssv_get_var_block(char *vname);
 void ssv_set_dummy(char *vname);
 soundscript_var ssv_get_var(char *vname);
+const char *ssv_get_name(soundscript_var var);
 int ssv_makes_use_of(soundscript_var var1, soundscript_var var2);
 int ssv_speculate_cycle(char *vname, msynth_modifier graph);
 int ssv_validate_recursion(msynth_modifier graph, char *vname);
@@ -63,4 +79,6 @@ void ssv_recursively_mark_vars(soundscript_var var);
 void ssv_clear_marks(unsigned int clear);
 void ssv_regroup(void);
 void ssv_eval(struct sampleclock sc);
+void ssv_eval_block(struct sampleclock sc, int frames);
+struct _synth_tape *ssv_get_tape(void);
 
@@ -9,12 +9,16 @@
 %{
 #include <glib.h>
 #include <math.h>
+#include <string.h>
 #include "sampleclock.h"
 #include "synth.h"
 #include "soundscript_lex.h"
 #include "soundscript_parse.h"
 #include "soundscript.h"
 #include "transform.h"
+#include "tape.h"
+#include "optimize.h"
+#include "stats.h"
 
 void yyerror(const char *s);
 static void put_recursion_error() {
@@ -35,8 +39,8 @@ static void put_recursion_error() {
 }
 
 %token <number> NUM
-%token <name> IDENT
-%token EOL GARBAGE VOLUME
+%token <name> IDENT PATH
+%token EOL GARBAGE VOLUME ENGINE STATS PROFILE LOAD
 %type <mod> number expr_deep expr_mul expr_add
 %type <args> any_args require_args
 
@@ -65,6 +69,9 @@ line: EOL
                 YYERROR;
             }
 
+            /* Simplify graph, this may remove references */
+            opt_graph($4);
+
             /* Verify there is no recursion in normal variables */
             if (ssv_speculate_cycle($1, $4)) {
                 yyerror("Assignment would cause cycle in soundgraph,"
@@ -73,8 +80,7 @@ line: EOL
             }
 
             /* Perform assignment */
-            soundscript_mark_use($4);
-            ssv_set_var($1, $4);
+            ssv_set_var($1, opt_intern($4));
         }
 
     /* Recursive assignment */
@@ -95,9 +101,10 @@ line: EOL
                 YYERROR;
             }
 
+            opt_graph($4);
+
             /* Perform assignment */
-            soundscript_mark_use($4);
-            ssv_set_var_recursive($1, $4);
+            ssv_set_var_recursive($1, opt_intern($4));
         }
     | expr_add EOL {
             /* Validate recursion */
@@ -106,11 +113,10 @@ line: EOL
                 YYERROR;
             }
 
-            /* GC should not delete this */
-            soundscript_mark_use($1);
+            opt_graph($1);
 
             /* Change synthesizer signal */
-            synth_replace($1);
+            synth_replace(opt_intern($1));
         }
     | VOLUME EOL {
             printf("Current volume: %.1f%%\n", synth_get_volume());
@@ -121,6 +127,38 @@ line: EOL
             else
                 puts("Volume must be percentage from 0% to 100%");
         }
+    | STATS EOL {
+            stats_print();
+        }
+    | PROFILE EOL {
+            synth_profile(100);
+        }
+    | PROFILE NUM EOL {
+            if ($2 >= 1.f)
+                synth_profile((int)$2);
+            else
+                puts("Profile at least 1 period");
+        }
+    | ENGINE EOL {
+            printf("Current engine: %s\n",
+                tape_get_engine() == TAPE_ENGINE_NATIVE ? "native" : "tape");
+        }
+    | ENGINE IDENT EOL {
+            /* The new engine takes effect when the variables are regrouped */
+            if (!strcmp($2, "native")) {
+                if (tape_set_engine(TAPE_ENGINE_NATIVE))
+                    puts("Native code is not supported on this platform");
+            } else if (!strcmp($2, "tape")) {
+                tape_set_engine(TAPE_ENGINE_INTERPRETER);
+            } else {
+                puts("Engine must be either 'tape' or 'native'");
+            }
+        }
+    | LOAD PATH EOL {
+            /* The parser is not reentrant, the script is read once this
+             * line has been parsed */
+            soundscript_queue_load($2);
+        }
     ;
 
 expr_add: expr_mul
@@ -181,13 +219,13 @@ expr_deep: IDENT '(' any_args ')' {
     | expr_deep '[' NUM ']' {
             /* Modify recursive delays */
             if ($1->type == MSMT_VARIABLE &&
-                    ssv_get_var($1->data.varname)->recursive) {
+                    ssv_get_var($1->data.variable.name)->recursive) {
 
                 /* 0 delay is invalid */
                 if (roundf($3) == 0) {
                     fprintf(stderr, "Referencing recursive variable '%s'"
                         " with a delay of 0 samples, invalid.\n",
-                        $1->data.varname);
+                        $1->data.variable.name);
                     YYERROR;
 
                 /* Reference minus 1 */
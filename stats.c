@@ -0,0 +1,170 @@
+/* microsynth - Render loop statistics
+ *
+ * The synth thread records for every period the time spent rendering it,
+ * the time spent blocked on the device and the time spent picking up the
+ * latest graph. Render times feed a log-linear histogram (8 buckets for
+ * every power of 2 nanoseconds, so within 12.5%), from which percentiles
+ * are taken. The DSP load is the render time relative to the period.
+ *
+ * Only the synth thread writes the statistics, any other thread may read
+ * them at any time. Being the single writer, the synth thread updates
+ * every counter with a plain atomic store (no locked instructions), readers
+ * may see a period half recorded, which is harmless for telemetry.
+ */
+#include <time.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+/* Render time histogram buckets, see _stats_bucket */
+#define RENDER_BUCKETS (64 * 8)
+
+/* Most recent xruns remembered */
+#define XRUN_TIMES 8
+
+/* Relaxed accessors, for a single writer and any amount of readers */
+#define GET(X) __atomic_load_n(&(X), __ATOMIC_RELAXED)
+#define SET(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELAXED)
+#define ADD(X, V) SET(X, GET(X) + (V))
+#define MAX(X, V) if ((V) > GET(X)) SET(X, V)
+
+/* Duration of a period, 0 while not playing */
+static long long period_ns = 0;
+static long long start_ns = 0;
+
+/* Per period statistics */
+static long long periods = 0;
+static long long histogram[RENDER_BUCKETS];
+static long long render_total = 0, render_max = 0;
+static long long blocked_total = 0, blocked_max = 0;
+static long long graph_total = 0, graph_max = 0;
+
+/* Xruns and the time they happened, relative to start_ns */
+static long long xruns = 0;
+static long long xrun_times[XRUN_TIMES];
+
+/* Return the histogram bucket of a render time
+ *
+ * Times below 8 ns have a bucket each, larger times are split by their
+ * highest bit set (b) and the three bits below it (s) into bucket
+ * b * 8 + s.
+ */
+static int _stats_bucket(long long ns)
+{
+    int bit;
+
+    if (ns < 8)
+        return ns < 0 ? 0 : ns;
+
+    bit = 63 - __builtin_clzll(ns);
+    return bit * 8 + ((ns >> (bit - 3)) & 7);
+}
+
+/* Return the first render time beyond a histogram bucket */
+static long long _stats_bucket_end(int bucket)
+{
+    if (bucket < 8)
+        return bucket + 1;
+
+    return (long long)(8 + bucket % 8 + 1) << (bucket / 8 - 3);
+}
+
+/* Monotonic time in nanoseconds */
+long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Start recording, with periods of the given duration */
+void stats_start(long long period)
+{
+    start_ns = stats_now();
+    SET(period_ns, period);
+
+    return;
+}
+
+/* Record a period, all times in nanoseconds */
+void stats_period(long long blocked, long long graph, long long render)
+{
+    ADD(histogram[_stats_bucket(render)], 1);
+
+    ADD(render_total, render);
+    MAX(render_max, render);
+    ADD(blocked_total, blocked);
+    MAX(blocked_max, blocked);
+    ADD(graph_total, graph);
+    MAX(graph_max, graph);
+
+    ADD(periods, 1);
+
+    return;
+}
+
+/* Record an xrun */
+void stats_xrun(void)
+{
+    SET(xrun_times[GET(xruns) % XRUN_TIMES], stats_now() - start_ns);
+    ADD(xruns, 1);
+
+    return;
+}
+
+/* Return the render time in microseconds below which the given fraction of
+ * all periods was rendered, by the end of its bucket */
+static double _stats_percentile(long long count, double fraction)
+{
+    long long seen = 0, end;
+    int i;
+
+    for (i = 0; i < RENDER_BUCKETS - 1; i++) {
+        seen += GET(histogram[i]);
+        if (seen >= count * fraction)
+            break;
+    }
+
+    end = _stats_bucket_end(i);
+    if (end > GET(render_max))
+        end = GET(render_max);
+
+    return end * 1e-3;
+}
+
+/* Print the statistics recorded so far */
+void stats_print(void)
+{
+    long long count, period, n, first;
+    int i;
+
+    period = GET(period_ns);
+    count = GET(periods);
+    if (!period || !count) {
+        puts("No periods played yet");
+        return;
+    }
+
+    printf("Periods: %lld of %.3f ms\n", count, period * 1e-6);
+    printf("DSP load: %.1f%% average, %.1f%% at most\n",
+        100.0 * GET(render_total) / count / period,
+        100.0 * GET(render_max) / period);
+    printf("Render time: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        _stats_percentile(count, 0.5), _stats_percentile(count, 0.99),
+        GET(render_max) * 1e-3);
+    printf("Blocked on device: %.0f us average, %.0f us at most\n",
+        GET(blocked_total) / count * 1e-3, GET(blocked_max) * 1e-3);
+    printf("Graph pickup: %.2f us average, %.2f us at most\n",
+        GET(graph_total) / count * 1e-3, GET(graph_max) * 1e-3);
+
+    n = GET(xruns);
+    printf("Xruns: %lld", n);
+    first = n > XRUN_TIMES ? n - XRUN_TIMES : 0;
+    for (i = 0; first + i < n; i++)
+        printf("%s%.3f s", i ? ", " : (first ? ", last at " : " at "),
+            GET(xrun_times[(first + i) % XRUN_TIMES]) * 1e-9);
+    puts("");
+
+    return;
+}
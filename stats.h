@@ -0,0 +1,6 @@
+/* Render loop statistics */
+long long stats_now(void);
+void stats_start(long long period_ns);
+void stats_period(long long blocked, long long graph, long long render);
+void stats_xrun(void);
+void stats_print(void);
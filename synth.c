@@ -4,24 +4,43 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 
 #include <asoundlib.h>
 #include <pthread.h>
 #include <glib.h>
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
 /* msynth headers */
 #include "main.h"
 #include "sampleclock.h"
 #include "gen.h"
 #include "synth.h"
 #include "soundscript.h"
+#include "transform.h"
+#include "optimize.h"
+#include "tape.h"
+#include "slab.h"
+#include "region.h"
+#include "rt.h"
+#include "stats.h"
 
 static void *_msynth_thread_main(void *arg);
+static void _msynth_null_signal(void);
+static double _synth_now(void);
+static void _synth_le32(unsigned char *p, unsigned int v);
+static void _synth_wav_header(FILE *out, unsigned int rate,
+    unsigned int frames);
 
 /* pthread globals */
 static pthread_t synthread;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int started = 0;
 
 /* ALSA stuff */
 static snd_pcm_t *pcm;
@@ -32,6 +51,7 @@ static int dir = 0;
 static snd_pcm_uframes_t
     buffer_size = 0,
     period_size = 0;
+static int use_mmap = 0;
 
 /* microsynth settings */
 static volatile int shutdown = 0;
@@ -40,7 +60,53 @@ static volatile float volume = 0.5f;
 /* microsynth stats */
 static int recover_resumes = 0, recover_xruns = 0;
 
-/* Big Synthesizer Lock */
+/* Offline rendering samplerate, unless configured */
+#define MSYNTH_RENDER_RATE 48000
+
+/* Most frames a WAV file can hold, its sizes are 32-bit. Raw files are only
+ * limited to something that takes forever to render.
+ */
+#define MSYNTH_RENDER_WAV_FRAMES ((0xffffffffU - 50) / 8)
+#define MSYNTH_RENDER_RAW_FRAMES (1LL << 52)
+
+/* Graph publication
+ *
+ * The synth thread never waits for edits. Edited graphs are lowered into a
+ * new tape, which is published with an atomic pointer swap and picked up
+ * by the synth thread at the start of its next period.
+ *
+ * Memory the synth thread may still be using is retired instead of freed,
+ * and reclaimed once the synth thread is known to have left the old tape
+ * (quiescent state based reclamation):
+ *  - publish_epoch is advanced by every publication.
+ *  - render_epoch holds the publish_epoch the synth thread saw when it
+ *    started rendering the current period, 0 when it is not rendering.
+ */
+static unsigned int publish_epoch = 1;
+static unsigned int render_epoch = 0;
+static GPtrArray *limbo = NULL; /* Retired graph nodes */
+
+/* Graph nodes and their small local storage, only the control thread
+ * allocates and frees them */
+static slab node_slab = NULL;
+static slab state_slab = NULL;
+
+/* Temporary graph nodes, see synth_begin_temporary */
+struct temp_node {
+    struct temp_node *next;
+    struct _msynth_modifier mod;
+};
+static region temp_region = NULL;
+static struct temp_node *temp_nodes = NULL;
+
+/* Publication stats */
+static int publish_swaps = 0;
+static double reclaim_wait = 0.0, reclaim_wait_max = 0.0;
+
+/* Edit lock
+ *
+ * Serializes changes to the sound graphs, the synth thread does not use it.
+ */
 void synth_lock_graphs()
 {
     pthread_mutex_lock(&mutex);
@@ -56,10 +122,7 @@ void synth_unlock_graphs()
  */
 void msynth_init()
 {
-    /* Setup null signal */
-    ssv_set_var("right", soundscript_mark_use(ssb_number(0.)));
-    ssv_set_var("left", soundscript_mark_use(ssb_number(0.)));
-    ssv_regroup();
+    _msynth_null_signal();
 
     /* Start synth thread */
     if (pthread_create(&synthread, NULL, _msynth_thread_main, NULL)) {
@@ -69,16 +132,419 @@ void msynth_init()
 
     /* Wait for synth to initialize */
     pthread_mutex_lock(&mutex);
-    pthread_cond_wait(&cond, &mutex);
+    while (!started)
+        pthread_cond_wait(&cond, &mutex);
     pthread_mutex_unlock(&mutex);
 
     return;
 }
 
+/* Setup null signal */
+static void _msynth_null_signal(void)
+{
+    ssv_set_var("right", ssb_number(0.));
+    ssv_set_var("left", ssb_number(0.));
+    ssv_regroup();
+    return;
+}
+
+/* Setup synthesizer for offline rendering, no audio device is opened
+ *
+ * THIS FUNCTION MAKES USE OF SOUNDSCRIPT AND MUST THEREFORE BE CALLEED AFTER
+ * soundscript_init
+ */
+void msynth_init_offline()
+{
+    _msynth_null_signal();
+    return;
+}
+
+/* Render the current sound graphs to a file, as fast as possible
+ *
+ * Files ending in ".raw" receive interleaved native floats, any other file
+ * becomes a 32-bit float WAV file. Samples are written unscaled, the volume
+ * only applies to the sound card. Lengths that do not fit a WAV file are
+ * refused.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int msynth_render(char *path, float seconds)
+{
+    FILE *out;
+    float *left, *right;
+    unsigned char *buf;
+    unsigned int rate;
+    int j, frames, raw, len = strlen(path);
+    long long i, total;
+    double start, elapsed, length;
+    struct sampleclock sc;
+    soundscript_var out_left, out_right;
+    union {
+        float f;
+        unsigned int u;
+    } sample;
+
+    rate = config.srate != -1 ? config.srate : MSYNTH_RENDER_RATE;
+    raw = len > 4 && !strcmp(path + len - 4, ".raw");
+
+    /* Count frames in double, long renders overflow a float or an int */
+    length = (double)seconds * rate + 0.5;
+    if (raw && !(length < MSYNTH_RENDER_RAW_FRAMES)) {
+        fprintf(stderr, "render: %g seconds is too long\n", seconds);
+        return -1;
+    }
+    if (!raw && !(length < MSYNTH_RENDER_WAV_FRAMES + 1.0)) {
+        fprintf(stderr, "render: %g seconds does not fit a WAV file "
+            "(at most %.0f s), render to a .raw file instead\n", seconds,
+            (double)MSYNTH_RENDER_WAV_FRAMES / rate);
+        return -1;
+    }
+    total = (long long)length;
+
+    out = fopen(path, "wb");
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+
+    buf = malloc(MSYNTH_BLOCK * 2 * sizeof(float));
+    if (!buf) {
+        perror("malloc render buffer failed");
+        fclose(out);
+        return -1;
+    }
+
+    if (!raw)
+        _synth_wav_header(out, rate, (unsigned int)total);
+
+    out_left = ssv_get_var("left");
+    out_right = ssv_get_var("right");
+    sc = sc_from_samples(rate, 0);
+    start = _synth_now();
+
+    for (i = 0; i < total; i += frames) {
+        frames = total - i > MSYNTH_BLOCK ? MSYNTH_BLOCK : (int)(total - i);
+
+        /* Evaluate variables */
+        tape_run(ssv_get_tape(), sc, frames);
+        left = out_left->block;
+        right = out_right->block;
+
+        /* Interleave, WAV files are little-endian */
+        for (j = 0; j < frames; j++) {
+            if (raw) {
+                ((float *)buf)[j * 2] = left[j];
+                ((float *)buf)[j * 2 + 1] = right[j];
+                continue;
+            }
+
+            sample.f = left[j];
+            _synth_le32(buf + j * 8, sample.u);
+            sample.f = right[j];
+            _synth_le32(buf + j * 8 + 4, sample.u);
+        }
+
+        fwrite(buf, 2 * sizeof(float), frames, out);
+        sc = sc_advance(sc, frames);
+    }
+
+    elapsed = _synth_now() - start;
+    free(buf);
+
+    if (ferror(out) | fclose(out)) {
+        perror(path);
+        return -1;
+    }
+
+    printf("render: %lli samples in %.3f s (%.1fx realtime)\n", total,
+        elapsed, elapsed > 0.0 ? total / (double)rate / elapsed : 0.0);
+
+    return 0;
+}
+
+/* Store 32-bit little-endian value */
+static void _synth_le32(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+    return;
+}
+
+/* Write WAV header for stereo 32-bit float samples */
+static void _synth_wav_header(FILE *out, unsigned int rate,
+    unsigned int frames)
+{
+    unsigned char h[58];
+    unsigned int size = frames * 8;
+
+    memcpy(h, "RIFF", 4);
+    _synth_le32(h + 4, 50 + size);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    _synth_le32(h + 16, 18);
+    _synth_le32(h + 20, 3 | 2 << 16);   /* IEEE float, 2 channels */
+    _synth_le32(h + 24, rate);
+    _synth_le32(h + 28, rate * 8);      /* Bytes per second */
+    _synth_le32(h + 32, 8 | 32 << 16);  /* Block align, bits per sample */
+    h[36] = h[37] = 0;                  /* No format extension */
+    memcpy(h + 38, "fact", 4);
+    _synth_le32(h + 42, 4);
+    _synth_le32(h + 46, frames);
+    memcpy(h + 50, "data", 4);
+    _synth_le32(h + 54, size);
+
+    fwrite(h, sizeof(h), 1, out);
+    return;
+}
+
 void msynth_shutdown()
 {
     shutdown = 1;
     pthread_join(synthread, NULL);
+
+    if (publish_swaps)
+        printf("synthread: %i graph swaps, reclamation waited %.3f ms "
+            "(at most %.3f ms)\n", publish_swaps, reclaim_wait * 1e3,
+            reclaim_wait_max * 1e3);
+    return;
+}
+
+/* Monotonic time in seconds */
+static double _synth_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Wait until the synth thread left all previously published tapes
+ *
+ * Must be called after publishing a new tape. Afterwards all graph nodes
+ * retired so far are freed, and the caller may free the old tape. When
+ * the synth thread is not rendering, this does not wait at all.
+ */
+void synth_synchronize(void)
+{
+    unsigned int epoch, reader;
+    double start, wait;
+    msynth_modifier mod;
+    int i;
+
+    epoch = __atomic_add_fetch(&publish_epoch, 1, __ATOMIC_SEQ_CST);
+
+    start = _synth_now();
+    for (;;) {
+        /* Idle, or rendering a period started after the publication */
+        reader = __atomic_load_n(&render_epoch, __ATOMIC_SEQ_CST);
+        if (!reader || (int)(reader - epoch) >= 0)
+            break;
+
+        usleep(100);
+    }
+    wait = _synth_now() - start;
+
+    publish_swaps++;
+    reclaim_wait += wait;
+    if (wait > reclaim_wait_max)
+        reclaim_wait_max = wait;
+
+    /* Reclaim retired nodes */
+    if (limbo) {
+        for (i = 0; i < limbo->len; i++) {
+            mod = g_ptr_array_index(limbo, i);
+            synth_free_storage(mod);
+            synth_free_modifier(mod);
+        }
+        g_ptr_array_set_size(limbo, 0);
+    }
+
+    return;
+}
+
+/* -------- Output conversion -------- */
+
+/* Convert blocks of left and right samples into interleaved output frames,
+ * scaled by volume and clipped. The vector kernels convert 4 frames at a
+ * time, the scalar code the remaining frames (or all on other platforms).
+ */
+
+/* Native float output, clipped to [-1, 1] */
+static void _synth_convert_float(void *out, float *left, float *right,
+    int frames, float gain)
+{
+    float *o = out, l, r;
+    int i = 0;
+
+#if defined(__x86_64__)
+    __m128 g = _mm_set1_ps(gain),
+        hi = _mm_set1_ps(1.0f),
+        lo = _mm_set1_ps(-1.0f),
+        vl, vr;
+
+    for (; i + 4 <= frames; i += 4) {
+        vl = _mm_mul_ps(_mm_loadu_ps(left + i), g);
+        vr = _mm_mul_ps(_mm_loadu_ps(right + i), g);
+        vl = _mm_max_ps(_mm_min_ps(vl, hi), lo);
+        vr = _mm_max_ps(_mm_min_ps(vr, hi), lo);
+        _mm_storeu_ps(o + i * 2, _mm_unpacklo_ps(vl, vr));
+        _mm_storeu_ps(o + i * 2 + 4, _mm_unpackhi_ps(vl, vr));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        l = left[i] * gain;
+        r = right[i] * gain;
+        o[i * 2] = l > 1.0f ? 1.0f : (l < -1.0f ? -1.0f : l);
+        o[i * 2 + 1] = r > 1.0f ? 1.0f : (r < -1.0f ? -1.0f : r);
+    }
+
+    return;
+}
+
+/* Clip and truncate to a 32-bit integer
+ *
+ * 2147483520 is the largest float below 2^31, clipping in float keeps the
+ * conversion from overflowing.
+ */
+static int32_t _synth_clip_s32(float x)
+{
+    if (x > 2147483520.0f) x = 2147483520.0f;
+    if (x < -2147483648.0f) x = -2147483648.0f;
+    return (int32_t)x;
+}
+
+/* Signed 32-bit output */
+static void _synth_convert_s32(void *out, float *left, float *right,
+    int frames, float gain)
+{
+    int32_t *o = out;
+    int i = 0;
+
+    gain *= 2147483648.0f;
+
+#if defined(__x86_64__)
+    __m128 g = _mm_set1_ps(gain),
+        hi = _mm_set1_ps(2147483520.0f),
+        lo = _mm_set1_ps(-2147483648.0f);
+    __m128i vl, vr;
+
+    for (; i + 4 <= frames; i += 4) {
+        vl = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(
+            _mm_mul_ps(_mm_loadu_ps(left + i), g), hi), lo));
+        vr = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(
+            _mm_mul_ps(_mm_loadu_ps(right + i), g), hi), lo));
+        _mm_storeu_si128((__m128i *)(o + i * 2), _mm_unpacklo_epi32(vl, vr));
+        _mm_storeu_si128((__m128i *)(o + i * 2 + 4),
+            _mm_unpackhi_epi32(vl, vr));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        o[i * 2] = _synth_clip_s32(left[i] * gain);
+        o[i * 2 + 1] = _synth_clip_s32(right[i] * gain);
+    }
+
+    return;
+}
+
+/* Clip and truncate to a 16-bit integer */
+static int16_t _synth_clip_s16(double x)
+{
+    if (x > 32767.0) x = 32767.0;
+    if (x < -32768.0) x = -32768.0;
+    return (int16_t)x;
+}
+
+#if defined(__x86_64__)
+/* Scale 2 frames by gain, clip and truncate them to 32-bit integers */
+static __m128i _synth_scale_s16(__m128 frames, __m128d gain)
+{
+    return _mm_cvttpd_epi32(_mm_max_pd(_mm_min_pd(
+        _mm_mul_pd(_mm_cvtps_pd(frames), gain), _mm_set1_pd(32767.0)),
+        _mm_set1_pd(-32768.0)));
+}
+#endif
+
+/* Signed 16-bit output, packing clips the samples
+ *
+ * Samples are scaled in double, as microsynth always did: 32767.5 * gain
+ * is exact, so every sample is rounded once, the same as before.
+ */
+static void _synth_convert_s16(void *out, float *left, float *right,
+    int frames, float gain)
+{
+    int16_t *o = out;
+    int i = 0;
+    double g = 32767.5 * gain;
+
+#if defined(__x86_64__)
+    __m128d vg = _mm_set1_pd(g);
+    __m128 l, r, lr;
+
+    for (; i + 4 <= frames; i += 4) {
+        /* Clip before truncating, out of range doubles do not saturate */
+        l = _mm_loadu_ps(left + i);
+        r = _mm_loadu_ps(right + i);
+        lr = _mm_unpacklo_ps(l, r);
+        l = _mm_unpackhi_ps(l, r);
+        _mm_storeu_si128((__m128i *)(o + i * 2), _mm_packs_epi32(
+            _mm_unpacklo_epi64(_synth_scale_s16(lr, vg),
+                _synth_scale_s16(_mm_movehl_ps(lr, lr), vg)),
+            _mm_unpacklo_epi64(_synth_scale_s16(l, vg),
+                _synth_scale_s16(_mm_movehl_ps(l, l), vg))));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        o[i * 2] = _synth_clip_s16(left[i] * g);
+        o[i * 2 + 1] = _synth_clip_s16(right[i] * g);
+    }
+
+    return;
+}
+
+/* Output sample formats in order of preference */
+static const struct _synth_format {
+    snd_pcm_format_t format;
+    const char *name;
+    int bytes;
+    void (*convert)(void *out, float *left, float *right, int frames,
+        float gain);
+} synth_formats[] = {
+    {SND_PCM_FORMAT_FLOAT, "float", 4, _synth_convert_float},
+    {SND_PCM_FORMAT_S32, "s32", 4, _synth_convert_s32},
+    {SND_PCM_FORMAT_S16, "s16", 2, _synth_convert_s16}
+};
+#define SYNTH_FORMATS (sizeof(synth_formats) / sizeof(synth_formats[0]))
+
+/* Selected output format */
+static const struct _synth_format *output = &synth_formats[SYNTH_FORMATS - 1];
+
+/* Render frames into interleaved output frames at out
+ *
+ * Evaluates the tape a block at a time and converts every block straight
+ * into out, which may be the mapped device buffer.
+ */
+static void _synth_render(synth_tape tape, struct sampleclock *sc,
+    soundscript_var out_left, soundscript_var out_right, char *out,
+    int frames)
+{
+    int i, n;
+
+    for (i = 0; i < frames; i += n) {
+        n = frames - i;
+        if (n > MSYNTH_BLOCK)
+            n = MSYNTH_BLOCK;
+
+        tape_run(tape, *sc, n);
+        output->convert(out + i * 2 * output->bytes, out_left->block,
+            out_right->block, n, volume);
+
+        *sc = sc_advance(*sc, n);
+    }
+
     return;
 }
 
@@ -90,17 +556,100 @@ void msynth_shutdown()
         exit(EXIT_FAILURE); \
     }
 
+/* Wait until the device buffer has room for a whole period (mmap access) */
+static void _synth_wait_period(void)
+{
+    snd_pcm_sframes_t avail;
+    int err;
+
+    for (;;) {
+        avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            err = synth_recover(avail);
+            ALSERT("querying available frames");
+            continue;
+        }
+
+        if (avail >= period_size)
+            return;
+
+        /* The buffer is full but playback did not start yet */
+        if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+            err = snd_pcm_start(pcm);
+            ALSERT("starting playback");
+            continue;
+        }
+
+        err = snd_pcm_wait(pcm, -1);
+        if (err < 0) {
+            err = synth_recover(err);
+            ALSERT("waiting for device");
+        }
+    }
+}
+
+/* Render a period straight into the mapped device buffer
+ *
+ * The period may wrap around the end of the buffer, in which case it is
+ * mapped (and committed) in two parts. A short commit is no xrun, the
+ * frames it left out are still in the buffer and are committed on the next
+ * pass without rendering them again.
+ */
+static void _synth_render_mmap(synth_tape tape, struct sampleclock *sc,
+    soundscript_var out_left, soundscript_var out_right)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames, done, rendered = 0;
+    snd_pcm_sframes_t committed;
+    int err;
+
+    for (done = 0; done < period_size; done += frames) {
+        frames = period_size - done;
+        err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+        if (err < 0) {
+            err = synth_recover(err);
+            ALSERT("mapping device buffer");
+            frames = 0;
+            continue;
+        }
+
+        /* Interleaved access, all channels share the first area */
+        if (done < rendered) {
+            if (frames > rendered - done)
+                frames = rendered - done;
+        } else {
+            _synth_render(tape, sc, out_left, out_right,
+                (char *)areas[0].addr + (areas[0].first +
+                offset * areas[0].step) / 8, frames);
+            rendered = done + frames;
+        }
+
+        committed = snd_pcm_mmap_commit(pcm, offset, frames);
+        if (committed < 0) {
+            err = synth_recover(committed);
+            ALSERT("committing audio");
+        } else {
+            frames = committed;
+        }
+    }
+
+    return;
+}
+
 static void *_msynth_thread_main(void *arg)
 {
     int i;
     int err;
-    int sample;
     int processed;
+    long long t_wait, t_graph, t_render, t_done;
+    soundscript_var out_left, out_right;
+    synth_tape tape;
 
-    struct sampleclock sc = {0, 0, 0.0f, 0.0f};
-    msynth_frame fb = NULL;
+    struct sampleclock sc = {0, 0, 0.0};
+    char *fb = NULL;
 
     puts("synthread: started");
+    rt_thread(0);
 
     /* Begin initialization of ALSA */
     /* snd_pcm_open(pcm_handle, device_name, stream_type, open_mode) */
@@ -138,14 +687,27 @@ static void *_msynth_thread_main(void *arg)
     ALSERT("setting samplerate");
     printf("synthread: Detected samplerate of %u\n", srate);
 
-    /* RW interleaved access (means we will use the snd_pcm_writei function) */
-    err = snd_pcm_hw_params_set_access(pcm, hw_p,
-        SND_PCM_ACCESS_RW_INTERLEAVED);
+    /* Prefer mmap interleaved access, rendering straight into the device
+     * buffer. Otherwise RW interleaved access, writing a period buffer
+     * with snd_pcm_writei.
+     */
+    use_mmap = !snd_pcm_hw_params_test_access(pcm, hw_p,
+        SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    err = snd_pcm_hw_params_set_access(pcm, hw_p, use_mmap ?
+        SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED);
     ALSERT("setting access mode");
 
-    /* native-endian 16-bit signed sample format */
-    err = snd_pcm_hw_params_set_format(pcm, hw_p, SND_PCM_FORMAT_S16);
+    /* Native-endian sample format, float or 32-bit signed if available */
+    for (i = 0; i < SYNTH_FORMATS - 1; i++)
+        if (!snd_pcm_hw_params_test_format(pcm, hw_p,
+                synth_formats[i].format))
+            break;
+    output = &synth_formats[i];
+
+    err = snd_pcm_hw_params_set_format(pcm, hw_p, output->format);
     ALSERT("setting sample format");
+    printf("synthread: Selected %s samples, %s access\n", output->name,
+        use_mmap ? "mmap" : "rw");
 
     /* Switch to 2.0ch audio */
     err = snd_pcm_hw_params_set_channels(pcm, hw_p, 2);
@@ -227,20 +789,20 @@ static void *_msynth_thread_main(void *arg)
     err = snd_pcm_prepare(pcm);
     ALSERT("preparing device");
 
-    /* Allocate a period sized framebuffer
-     * (yup an audio buffer is in ALSA speak indeed called a framebuffer)
+    /* Allocate a period sized framebuffer, unless rendering into the
+     * device buffer (yup an audio buffer is in ALSA speak indeed called a
+     * framebuffer)
      */
-    fb = malloc(sizeof(struct _msynth_frame) * period_size);
-    if (!fb) {
-        perror("malloc framebuffer failed");
-        exit(1);
+    if (!use_mmap) {
+        fb = malloc(2 * output->bytes * period_size);
+        if (!fb) {
+            perror("malloc framebuffer failed");
+            exit(1);
+        }
     }
 
     /* Set sampleclock to 0 */
-    sc.samples = 0;
-    sc.samplerate = srate;
-    sc.cycle = 0.0f;
-    sc.seconds = 0.0f;
+    sc = sc_from_samples(srate, 0);
 
     /* Initially the <root> variable describing the flow of sound within
      * the synthesizer is configured to be a NULL signal. (silence)
@@ -248,43 +810,54 @@ static void *_msynth_thread_main(void *arg)
 
     /* Signal successful completion of initialization */
     pthread_mutex_lock(&mutex);
+    started = 1;
     pthread_cond_signal(&cond);
     pthread_mutex_unlock(&mutex);
 
-    /* -------------- Main loop --------------- */
-    while (!shutdown) {
-        /* Only during generation we need the synth tree to be static */
-        synth_lock_graphs();
-
-        for (i = 0; i < period_size; i++) {
-            /* Evaluate variables */
-            ssv_eval(sc);
-
-            sample = (int)(32767.5 * ssv_get_var_eval("left") * volume);
-
-            /* Clip samples */
-            if (sample > 32767) sample = 32767;
-            if (sample < -32768) sample = -32768;
-
-            fb[i].left = (short)sample;
+    /* Output variables are never freed, look them up only once */
+    out_left = ssv_get_var("left");
+    out_right = ssv_get_var("right");
 
-            sample = (int)(32767.5 * ssv_get_var_eval("right") * volume);
+    stats_start(period_size * 1000000000LL / srate);
 
-            /* Clip samples */
-            if (sample > 32767) sample = 32767;
-            if (sample < -32768) sample = -32768;
-
-            fb[i].right = (short)sample;
+    /* -------------- Main loop --------------- */
+    while (!shutdown) {
+        /* Block until the device takes a period, outside of the epoch */
+        t_wait = stats_now();
+        if (use_mmap)
+            _synth_wait_period();
 
-            sc = sc_from_samples(sc.samplerate, sc.samples + 1);
+        /* Enter the current epoch, then pick up the latest tape, which
+         * is not reclaimed before we report a quiescent state.
+         */
+        t_graph = stats_now();
+        __atomic_store_n(&render_epoch,
+            __atomic_load_n(&publish_epoch, __ATOMIC_SEQ_CST),
+            __ATOMIC_SEQ_CST);
+        tape = ssv_get_tape();
+
+        /* Evaluate variables */
+        t_render = stats_now();
+        if (use_mmap)
+            _synth_render_mmap(tape, &sc, out_left, out_right);
+        else
+            _synth_render(tape, &sc, out_left, out_right, fb, period_size);
+
+        /* Quiescent state, the tape is no longer in use */
+        __atomic_store_n(&render_epoch, 0, __ATOMIC_SEQ_CST);
+        t_done = stats_now();
+
+        if (use_mmap) {
+            stats_period(t_graph - t_wait, t_render - t_graph,
+                t_done - t_render);
+            continue;
         }
 
-        synth_unlock_graphs();
-
         /* Send audio to sound card */
         processed = 0;
         while (processed != period_size) {
-            err = snd_pcm_writei(pcm, fb + processed, period_size - processed);
+            err = snd_pcm_writei(pcm, fb + processed * 2 * output->bytes,
+                period_size - processed);
 
             /* Retry on interruption by signal */
             if (err == -EAGAIN)
@@ -300,6 +873,9 @@ static void *_msynth_thread_main(void *arg)
             /* Update processed samples */
             processed += err;
         }
+
+        stats_period(stats_now() - t_done, t_render - t_graph,
+            t_done - t_render);
     }
 
     puts("synthread: shutting down");
@@ -307,9 +883,9 @@ static void *_msynth_thread_main(void *arg)
     /* Dump any statistics recorded */
     if (recover_resumes)
         printf("synthread: Device was resumed %i times\n", recover_resumes);
-    if (recover_xruns)
-        printf("synthread: %i xrun recoveries were needed\n", recover_xruns);
-    printf("synthread: processed %i samples\n", sc.samples);
+    printf("synthread: %i xrun recoveries were needed (%s)\n",
+        recover_xruns, rt_describe());
+    printf("synthread: processed %lld samples\n", (long long)sc.samples);
 
     /* Wait for playback to complete */
     err = snd_pcm_drain(pcm);
@@ -322,6 +898,7 @@ static void *_msynth_thread_main(void *arg)
     /* Clean up parameters */
     snd_pcm_hw_params_free(hw_p);
     snd_pcm_sw_params_free(sw_p);
+    free(fb);
 
     return NULL;
 }
@@ -335,6 +912,7 @@ int synth_recover(int err)
         ALSERT("recovering from underrun");
 
         recover_xruns++;
+        stats_xrun();
         return 0;
     }
 
@@ -355,6 +933,37 @@ int synth_recover(int err)
     return err;
 }
 
+/* Profile the graphs while playing the given amount of periods, then print
+ * the profile
+ *
+ * Playback continues meanwhile, edits have to wait.
+ */
+void synth_profile(int periods)
+{
+    synth_tape tape;
+    long long frames;
+    double deadline;
+
+    if (!started) {
+        puts("Profiling requires playback");
+        return;
+    }
+
+    tape = ssv_get_tape();
+    frames = (long long)periods * period_size;
+    tape_profile_start(tape);
+
+    /* Give up when the synth thread stalls */
+    deadline = _synth_now() + 2.0 * frames / srate + 1.0;
+    while (tape_profile_frames(tape) < frames && _synth_now() < deadline)
+        usleep(1000);
+
+    tape_profile_stop();
+    tape_profile_print(tape);
+
+    return;
+}
+
 /* Replace audio flow tree
  *
  * NOTE: you should not call this function
@@ -363,7 +972,7 @@ int synth_recover(int err)
 void synth_replace(msynth_modifier tree)
 {
     ssv_set_var("right", tree);
-    ssv_set_var("left", soundscript_mark_use(ssb_variable("right")));
+    ssv_set_var("left", opt_intern(ssb_variable("right")));
     return;
 }
 
@@ -376,34 +985,234 @@ void synth_replace(msynth_modifier tree)
  */
 float synth_eval(msynth_modifier mod, struct sampleclock sc)
 {
+    float r;
+
+    /* Shared nodes are only evaluated once per sample */
+    if (mod->refs > 1 && mod->eval_samples == sc.samples)
+        return mod->eval;
+
     switch(mod->type) {
         case MSMT_CONSTANT:
-            return mod->data.constant;
+            r = mod->data.constant;
+            break;
 
         case MSMT_NODE0:
-            return mod->data.node0.func(sc, &mod->storage);
+            r = mod->data.node0.func(sc, &mod->storage);
+            break;
 
         case MSMT_NODE1:
-            return mod->data.node.func(sc, &mod->storage,
+            r = mod->data.node.func(sc, &mod->storage,
                 synth_eval(mod->data.node.in, sc));
+            break;
 
         case MSMT_NODE2:
-            return mod->data.node2.func(sc, &mod->storage,
+            r = mod->data.node2.func(sc, &mod->storage,
                 synth_eval(mod->data.node2.a, sc),
                 synth_eval(mod->data.node2.b, sc));
+            break;
 
         case MSMT_VARIABLE:
-            return ssv_get_var_eval(mod->data.varname);
+            r = mod->data.variable.var->last_eval;
+            break;
 
-        default:;
+        default:
+            r = 0.0f;
     }
 
-    return 0.0f;
+    mod->eval_samples = sc.samples;
+    mod->eval = r;
+
+    return r;
+}
+
+/* Return whether mod is a temporary node */
+static int _synth_is_temporary(msynth_modifier mod)
+{
+    return temp_region && region_owns(temp_region, mod);
+}
+
+/* Allocate a long-lived graph node */
+static msynth_modifier _synth_slab_modifier(void)
+{
+    if (!node_slab)
+        node_slab = slab_new(sizeof(struct _msynth_modifier), 16);
+
+    return slab_alloc(node_slab);
+}
+
+/* Allocate a graph node, without local storage
+ *
+ * Between synth_begin_temporary and synth_end_temporary the node is
+ * temporary, see synth_promote.
+ */
+msynth_modifier synth_alloc_modifier(void)
+{
+    struct temp_node *temp;
+    msynth_modifier mod;
+
+    if (temp_region) {
+        temp = region_alloc(temp_region, sizeof(struct temp_node));
+        temp->next = temp_nodes;
+        temp_nodes = temp;
+        mod = &temp->mod;
+    } else {
+        mod = _synth_slab_modifier();
+    }
+
+    mod->storage = NULL;
+    mod->storage_size = 0;
+
+    return mod;
 }
 
-/* Recursively free synth modifier graph */
+/* Free a graph node, its local storage must be freed (or moved) first */
+void synth_free_modifier(msynth_modifier mod)
+{
+    /* Temporaries go with their region, only mark them released */
+    if (_synth_is_temporary(mod)) {
+        mod->refs = 0;
+        return;
+    }
+
+    slab_free(node_slab, mod);
+    return;
+}
+
+/* Build temporary nodes in r until synth_end_temporary
+ *
+ * Used while parsing a line: all nodes are carved from the region, only
+ * the nodes of accepted graphs are promoted to long-lived nodes. Whatever
+ * is left (rejected expressions, nodes replaced by shared ones) goes
+ * with the region, without any bookkeeping per node.
+ */
+void synth_begin_temporary(region r)
+{
+    temp_region = r;
+    temp_nodes = NULL;
+    return;
+}
+
+/* Release the temporaries which were not promoted
+ *
+ * Nodes are released one by one, children are temporaries themselves.
+ * The region may be reset afterwards.
+ */
+void synth_end_temporary(void)
+{
+    struct temp_node *temp;
+
+    for (temp = temp_nodes; temp; temp = temp->next) {
+        if (temp->mod.refs <= 0)
+            continue;
+
+        synth_free_storage(&temp->mod);
+        if (temp->mod.type == MSMT_VARIABLE)
+            free(temp->mod.data.variable.name);
+    }
+
+    temp_region = NULL;
+    temp_nodes = NULL;
+
+    return;
+}
+
+/* Move a temporary node into long-lived memory, returns the node to use
+ *
+ * Its children must have been promoted already. The temporary is marked
+ * released, its storage and name move along with it.
+ */
+msynth_modifier synth_promote(msynth_modifier mod)
+{
+    msynth_modifier copy;
+
+    if (!_synth_is_temporary(mod))
+        return mod;
+
+    copy = _synth_slab_modifier();
+    *copy = *mod;
+    mod->refs = 0;
+
+    return copy;
+}
+
+/* Allocate zeroed local storage of size bytes for mod
+ *
+ * Storage is allocated while building graphs, so the synth thread never
+ * allocates anything. Small storage (oscillators) comes from a slab, so
+ * the states of a freshly built graph lie next to each other.
+ */
+void synth_alloc_storage(msynth_modifier mod, size_t size)
+{
+    synth_free_storage(mod);
+
+    if (size <= SYNTH_STATE_SIZE) {
+        if (!state_slab)
+            state_slab = slab_new(SYNTH_STATE_SIZE, SYNTH_STATE_SIZE);
+
+        mod->storage = slab_alloc(state_slab);
+        memset(mod->storage, 0, SYNTH_STATE_SIZE);
+    } else {
+        mod->storage = calloc(1, size);
+        if (!mod->storage) {
+            perror("synth_alloc_storage.calloc");
+            exit(1);
+        }
+    }
+
+    mod->storage_size = size;
+
+    return;
+}
+
+/* Free the local storage of mod */
+void synth_free_storage(msynth_modifier mod)
+{
+    tf_delay_info di;
+
+    if (!mod->storage)
+        return;
+
+    /* Delays share their line with other taps */
+    if (ssb_is_delay(mod)) {
+        di = mod->storage;
+        if (di->line)
+            tf_delay_line_release(di->line);
+    }
+
+    if (mod->storage_size && mod->storage_size <= SYNTH_STATE_SIZE)
+        slab_free(state_slab, mod->storage);
+    else
+        free(mod->storage);
+
+    mod->storage = NULL;
+    mod->storage_size = 0;
+
+    return;
+}
+
+/* Return the amount of memory reserved for graph nodes and their small
+ * local storage
+ */
+size_t synth_reserved(void)
+{
+    return (node_slab ? slab_reserved(node_slab) : 0) +
+        (state_slab ? slab_reserved(state_slab) : 0);
+}
+
+/* Recursively free synth modifier graph
+ *
+ * Releases a single reference, shared nodes are only freed when their
+ * last reference is released. Freed nodes are reclaimed by the next
+ * synth_synchronize.
+ */
 void synth_free_recursive(msynth_modifier mod)
 {
+    if (--mod->refs > 0)
+        return;
+
+    /* No longer available for sharing */
+    opt_forget(mod);
+
     switch(mod->type) {
         case MSMT_NODE1:
             synth_free_recursive(mod->data.node.in);
@@ -416,15 +1225,25 @@ void synth_free_recursive(msynth_modifier mod)
 
         case MSMT_VARIABLE:
             /* Free strdup'ed string */
-            free(mod->data.varname);
+            free(mod->data.variable.name);
             break;
 
         default:;
     }
 
-    if (mod->storage)
-        free(mod->storage);
-    free(mod);
+    /* Temporaries were never published */
+    if (_synth_is_temporary(mod)) {
+        synth_free_storage(mod);
+        return;
+    }
+
+    /* The synth thread may still be evaluating the node, retire it until
+     * the next publication.
+     */
+    if (!limbo)
+        limbo = g_ptr_array_new();
+    g_ptr_array_add(limbo, mod);
+
     return;
 }
 
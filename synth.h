@@ -1,7 +1,9 @@
+#include <stddef.h>
+#include <float.h>
 
 /* synth types */
 typedef struct _msynth_modifier *msynth_modifier;
-typedef struct _msynth_frame *msynth_frame;
+struct _region;
 
 /* synth callbacks */
 typedef float (*msynth_modfunc0)(struct sampleclock sc, void **storage);
@@ -10,36 +12,78 @@ typedef float (*msynth_modfunc)(struct sampleclock sc, void **storage,
 typedef float (*msynth_modfunc2)(struct sampleclock sc, void **storage,
     float a, float b);
 
+/* synth block callbacks
+ *
+ * Block variants compute 'frames' consecutive samples at once, starting at
+ * sample clock sc. Output may alias any of the inputs.
+ */
+typedef void (*msynth_blockfunc0)(struct sampleclock sc, void **storage,
+    float *out, int frames);
+typedef void (*msynth_blockfunc)(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames);
+typedef void (*msynth_blockfunc2)(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+
+/* Maximum amount of frames evaluated in a single block */
+#define MSYNTH_BLOCK 256
+
+/* Largest local storage allocated from the state slab */
+#define SYNTH_STATE_SIZE 32
+
+/* Flush a denormal sample to zero, applied to the state carried from sample
+ * to sample by recursive graphs. Nothing to do where the CPU flushes
+ * denormals itself (see rt_flush_denormals). Evaluates x several times.
+ */
+#if defined(__SSE2__) || defined(__aarch64__)
+#define SYNTH_FLUSH(x) (x)
+#else
+#define SYNTH_FLUSH(x) ((x) > -FLT_MIN && (x) < FLT_MIN ? 0.0f : (x))
+#endif
+
 /* synth modifiers */
 struct _msynth_modifier {
     int type;
     void *storage;
 
+    /* Bytes of storage, allocated by synth_alloc_storage (or 0) */
+    size_t storage_size;
+
+    /* Amount of references, graphs share identical nodes */
+    int refs;
+
+    /* Last per sample evaluation of a shared node */
+    int64_t eval_samples;
+    float eval;
+
     union _msynth_modifier_data {
         struct _mod_node {
             msynth_modifier in;
             msynth_modfunc func;
+            msynth_blockfunc bfunc;
         } node;
 
         struct _mod_node2 {
             msynth_modifier a, b;
             msynth_modfunc2 func;
+            msynth_blockfunc2 bfunc;
         } node2;
 
         struct _mod_node0 {
             msynth_modfunc0 func;
+            msynth_blockfunc0 bfunc;
         } node0;
 
+        struct _mod_variable {
+            char *name;
+
+            /* Bound by ssv_regroup */
+            struct _soundscript_var *var;
+        } variable;
+
         float constant;
-        char *varname;
     } data;
 };
 
-struct _msynth_frame {
-    short left;
-    short right;
-};
-
 /* synth modification types */
 #define MSMT_INVALID   -1
 #define MSMT_CONSTANT   0
@@ -51,17 +95,31 @@ struct _msynth_frame {
 /* NULL signal */
 extern struct _msynth_modifier msynth_null_signal;
 
-/* Big Synth Lock */
+/* Edit lock, serializes changes to the sound graphs */
 void synth_lock_graphs();
 void synth_unlock_graphs();
 
+/* Graph publication */
+void synth_synchronize(void);
+
 /* synth interface */
 void msynth_init();
+void msynth_init_offline();
+int msynth_render(char *path, float seconds);
 void msynth_shutdown();
 int synth_recover(int err);
 float synth_eval(msynth_modifier mod, struct sampleclock sc);
 void synth_replace(msynth_modifier tree);
 void synth_free_recursive(msynth_modifier mod);
+msynth_modifier synth_alloc_modifier(void);
+void synth_free_modifier(msynth_modifier mod);
+void synth_begin_temporary(struct _region *r);
+void synth_end_temporary(void);
+msynth_modifier synth_promote(msynth_modifier mod);
+void synth_alloc_storage(msynth_modifier mod, size_t size);
+void synth_free_storage(msynth_modifier mod);
+size_t synth_reserved(void);
 void synth_set_volume(float new_volume);
 float synth_get_volume();
+void synth_profile(int periods);
 
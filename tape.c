@@ -0,0 +1,1037 @@
+/* microsynth - Sound graph instruction tape
+ *
+ * ssv_regroup lowers the graphs of all variables, in evaluation order, into
+ * a single array of instructions. Every graph is emitted in post-order, so
+ * the synth thread can evaluate all variables with a single loop over the
+ * tape, without recursion or chasing pointers through the graphs.
+ *
+ * Nodes shared between graphs are emitted only once, their result stays in
+ * its slot until every instruction reading it has been emitted.
+ *
+ * With a pool of several threads, the block instructions are lowered one
+ * variable (task) at a time, grouped in levels: a variable is placed in a
+ * later level than the variables it reads and the variables it shares nodes
+ * with. The tasks of a level run concurrently, so a slot released by a task
+ * is only reused by the same task or by tasks of later levels. Constants and
+ * variable reads are cheap, within tasks they are emitted for every reader
+ * instead of being shared, so they do not tie tasks together. Parallel
+ * tapes are always interpreted.
+ *
+ * A single tape at a time may be profiled (see tape_profile_start), it is
+ * then interpreted an instruction at a time, timing each instruction with
+ * the cycle counter. Other tapes run as usual, so profiling costs nothing
+ * when not in use, and stops by itself when the tape is replaced.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <glib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "sampleclock.h"
+#include "synth.h"
+#include "soundscript.h"
+#include "transform.h"
+#include "tape.h"
+#include "jit.h"
+#include "pool.h"
+
+/* Lowering state of a single graph node
+ *
+ * Graphs share nodes, a shared node is lowered once and its slot is kept
+ * until the last instruction reading it has been emitted.
+ */
+struct tape_node {
+    int uses;   /* Readers not emitted yet */
+    int slot;   /* Slot holding the result, -1 if not emitted yet */
+    int tail;   /* Result was computed by the per sample instructions */
+};
+
+/* Lowering state of a tape */
+struct tape_lowering {
+    synth_tape tape;
+    GHashTable *nodes;
+
+    /* Slot allocation, with the level and task that released a slot */
+    char *used;
+    int *released_level, *released_task;
+    int alloc;
+
+    /* Task being lowered, leaves are not shared within tasks */
+    int level, task;
+    int unshared;
+};
+
+/* Parallel evaluation of a block of frames */
+struct tape_job {
+    synth_tape tape;
+    struct sampleclock sc;
+    int frames;
+    int first;
+};
+
+/* Profile of a single node type or variable */
+struct tape_profile {
+    const char *name;
+    int nodes;
+    unsigned long long ticks;
+};
+
+/* Cycle counter, nanoseconds where not available */
+#if defined(__x86_64__) || defined(__i386__)
+#define TAPE_TICKS() __rdtsc()
+#else
+#define TAPE_TICKS() _tape_ns()
+#endif
+
+/* Local function definitions */
+static struct tape_op *_tape_emit(synth_tape tape, int op, int dst);
+static int _tape_alloc_slot(struct tape_lowering *tl);
+static int _tape_is_leaf(msynth_modifier mod);
+static void _tape_release(struct tape_lowering *tl, msynth_modifier mod,
+    int slot);
+static void _tape_count(struct tape_lowering *tl, msynth_modifier mod);
+static int _tape_lower(struct tape_lowering *tl, msynth_modifier mod);
+static void _tape_lower_var(struct tape_lowering *tl, soundscript_var var);
+static void _tape_level(GHashTable *owners, GHashTable *levels,
+    soundscript_var var, msynth_modifier mod, int *level);
+static void _tape_lower_tasks(struct tape_lowering *tl,
+    soundscript_var *vars, int count);
+static void _tape_run_task(void *arg, int index);
+static void _tape_finish(synth_tape tape);
+static unsigned long long _tape_ns(void);
+static void _tape_run_profiled(synth_tape tape, struct sampleclock sc,
+    int frames);
+static void _tape_run_task_profiled(void *arg, int index);
+static void _tape_exec_profiled(synth_tape tape, int start, int end,
+    struct sampleclock sc, int offset, int frames);
+
+/* Engine used for tapes finished from now on */
+static int engine = TAPE_ENGINE_INTERPRETER;
+
+/* Tape being profiled, NULL when not profiling */
+static synth_tape profiled = NULL;
+
+/* Cycle counter calibration, taken when profiling starts and stops, and
+ * the ticks spent reading the counter itself */
+static unsigned long long profile_ticks[2], profile_ns[2];
+static unsigned long long profile_overhead = 0;
+
+/* Allocate an empty tape */
+synth_tape tape_new(void)
+{
+    synth_tape tape = malloc(sizeof(struct _synth_tape));
+    assert(tape);
+
+    tape->size = 0;
+    tape->alloc = 64;
+    tape->ops = malloc(sizeof(struct tape_op) * tape->alloc);
+    assert(tape->ops);
+
+    tape->tail = -1;
+    tape->slots = 1;
+    tape->scratch = NULL;
+    tape->native = NULL;
+
+    tape->tasks = NULL;
+    tape->levels = NULL;
+    tape->nlevels = 0;
+
+    tape->vars = NULL;
+    tape->nvars = 0;
+
+    tape->ticks = NULL;
+    tape->frames = 0;
+
+    return tape;
+}
+
+/* Free a tape, the lowered graphs are not affected */
+void tape_free(synth_tape tape)
+{
+    if (!tape)
+        return;
+
+    jit_free(tape->native);
+    free(tape->ops);
+    free(tape->scratch);
+    free(tape->tasks);
+    free(tape->levels);
+    free(tape->vars);
+    free(tape->ticks);
+    free(tape);
+    return;
+}
+
+/* Append an instruction writing to slot dst */
+static struct tape_op *_tape_emit(synth_tape tape, int op, int dst)
+{
+    struct tape_op *top;
+
+    if (tape->size == tape->alloc) {
+        tape->alloc *= 2;
+        tape->ops = realloc(tape->ops, sizeof(struct tape_op) * tape->alloc);
+        assert(tape->ops);
+    }
+
+    top = tape->ops + tape->size++;
+    top->op = op;
+    top->dst = dst;
+    top->a = top->b = -1;
+    top->storage = NULL;
+
+    /* Keep track of the amount of slots in use */
+    if (dst >= tape->slots)
+        tape->slots = dst + 1;
+
+    return top;
+}
+
+/* Allocate the lowest free slot not in use by a concurrent task */
+static int _tape_alloc_slot(struct tape_lowering *tl)
+{
+    int slot;
+
+    for (slot = 0; slot < tl->alloc; slot++) {
+        if (!tl->used[slot] && (tl->released_level[slot] < tl->level ||
+                tl->released_task[slot] == tl->task))
+            break;
+    }
+
+    if (slot == tl->alloc) {
+        tl->alloc *= 2;
+        tl->used = realloc(tl->used, tl->alloc);
+        tl->released_level = realloc(tl->released_level,
+            sizeof(int) * tl->alloc);
+        tl->released_task = realloc(tl->released_task,
+            sizeof(int) * tl->alloc);
+        assert(tl->used && tl->released_level && tl->released_task);
+        memset(tl->used + slot, 0, tl->alloc - slot);
+        for (; slot < tl->alloc; slot++)
+            tl->released_level[slot] = -1;
+        slot = tl->alloc / 2;
+    }
+
+    tl->used[slot] = 1;
+    return slot;
+}
+
+/* Check if a node is a constant or variable read */
+static int _tape_is_leaf(msynth_modifier mod)
+{
+    return mod->type == MSMT_CONSTANT || mod->type == MSMT_VARIABLE;
+}
+
+/* Release a reader of mod (lowered into slot), the slot is freed after the
+ * last reader
+ */
+static void _tape_release(struct tape_lowering *tl, msynth_modifier mod,
+    int slot)
+{
+    struct tape_node *tn;
+
+    if (!(tl->unshared && _tape_is_leaf(mod))) {
+        tn = g_hash_table_lookup(tl->nodes, mod);
+        if (--tn->uses)
+            return;
+    }
+
+    tl->used[slot] = 0;
+    tl->released_level[slot] = tl->level;
+    tl->released_task[slot] = tl->task;
+
+    return;
+}
+
+/* Count the readers of every node in a graph */
+static void _tape_count(struct tape_lowering *tl, msynth_modifier mod)
+{
+    struct tape_node *tn = g_hash_table_lookup(tl->nodes, mod);
+
+    if (tn) {
+        tn->uses++;
+        return;
+    }
+
+    tn = malloc(sizeof(struct tape_node));
+    assert(tn);
+    tn->uses = 1;
+    tn->slot = -1;
+    tn->tail = 0;
+    g_hash_table_insert(tl->nodes, mod, tn);
+
+    switch(mod->type) {
+        case MSMT_NODE1:
+            _tape_count(tl, mod->data.node.in);
+            break;
+
+        case MSMT_NODE2:
+            _tape_count(tl, mod->data.node2.a);
+            _tape_count(tl, mod->data.node2.b);
+            break;
+
+        default:;
+    }
+
+    return;
+}
+
+/* Lower graph, returns the slot holding the result
+ *
+ * Inputs are released after the instruction reading them has been emitted,
+ * so the result may be written to the slot of one of its inputs.
+ */
+static int _tape_lower(struct tape_lowering *tl, msynth_modifier mod)
+{
+    synth_tape tape = tl->tape;
+    struct tape_node *tn = g_hash_table_lookup(tl->nodes, mod);
+    struct tape_op *top;
+    soundscript_var var;
+    int a, b, tail = tape->tail != -1;
+    int shared = !(tl->unshared && _tape_is_leaf(mod));
+
+    /* Shared node computed before */
+    if (shared && tn->slot != -1) {
+        if (tn->tail == tail)
+            return tn->slot;
+
+        /* Computed by the block instructions, the per sample instructions
+         * read it frame by frame. The block slot is never released.
+         */
+        top = _tape_emit(tape, TOP_LOAD, _tape_alloc_slot(tl));
+        top->a = tn->slot;
+        tn->slot = top->dst;
+        tn->tail = tail;
+        return tn->slot;
+    }
+
+    switch(mod->type) {
+        case MSMT_CONSTANT:
+            top = _tape_emit(tape, TOP_CONSTANT, _tape_alloc_slot(tl));
+            top->data.constant = mod->data.constant;
+            break;
+
+        case MSMT_VARIABLE:
+            var = mod->data.variable.var;
+
+            top = _tape_emit(tape, var->recursive ? TOP_RECURSIVE :
+                TOP_VARIABLE, _tape_alloc_slot(tl));
+            top->data.var = var;
+            break;
+
+        case MSMT_NODE0:
+            top = _tape_emit(tape, TOP_NODE0, _tape_alloc_slot(tl));
+            top->data.func0 = mod->data.node0.bfunc;
+            top->storage = &mod->storage;
+            break;
+
+        case MSMT_NODE1:
+            a = _tape_lower(tl, mod->data.node.in);
+            _tape_release(tl, mod->data.node.in, a);
+
+            top = _tape_emit(tape, TOP_NODE1, _tape_alloc_slot(tl));
+            top->a = a;
+            top->data.func1 = mod->data.node.bfunc;
+            top->storage = &mod->storage;
+            break;
+
+        case MSMT_NODE2:
+            a = _tape_lower(tl, mod->data.node2.a);
+            b = _tape_lower(tl, mod->data.node2.b);
+            _tape_release(tl, mod->data.node2.a, a);
+            _tape_release(tl, mod->data.node2.b, b);
+
+            /* Basic arithmetic is executed by the tape itself */
+            if (mod->data.node2.func == tf_add)
+                top = _tape_emit(tape, TOP_ADD, _tape_alloc_slot(tl));
+            else if (mod->data.node2.func == tf_sub)
+                top = _tape_emit(tape, TOP_SUB, _tape_alloc_slot(tl));
+            else if (mod->data.node2.func == tf_mul)
+                top = _tape_emit(tape, TOP_MUL, _tape_alloc_slot(tl));
+            else if (mod->data.node2.func == tf_div)
+                top = _tape_emit(tape, TOP_DIV, _tape_alloc_slot(tl));
+            else {
+                top = _tape_emit(tape, TOP_NODE2, _tape_alloc_slot(tl));
+                top->data.func2 = mod->data.node2.bfunc;
+                top->storage = &mod->storage;
+            }
+
+            top->a = a;
+            top->b = b;
+            break;
+
+        default:
+            top = _tape_emit(tape, TOP_CONSTANT, _tape_alloc_slot(tl));
+            top->data.constant = 0.0f;
+    }
+
+    if (shared) {
+        tn->slot = top->dst;
+        tn->tail = tail;
+    }
+
+    return top->dst;
+}
+
+/* Lower the graph of a variable and store the result in the variable */
+static void _tape_lower_var(struct tape_lowering *tl, soundscript_var var)
+{
+    struct tape_task *span = tl->tape->vars + tl->tape->nvars++;
+    struct tape_op *top;
+    int a;
+
+    span->start = tl->tape->size;
+    span->var = var;
+
+    a = _tape_lower(tl, var->vargraph);
+    _tape_release(tl, var->vargraph, a);
+
+    top = _tape_emit(tl->tape,
+        var->recursive ? TOP_STORE_RECURSIVE : TOP_STORE, -1);
+    top->a = a;
+    top->data.var = var;
+
+    span->end = tl->tape->size;
+
+    return;
+}
+
+/* Lower variables into a new tape
+ *
+ * vars: Variables in evaluation order, all variables starting at index
+ *       tail are evaluated sample by sample.
+ */
+synth_tape tape_lower(soundscript_var *vars, int count, int tail)
+{
+    struct tape_lowering tl;
+    struct tape_op *top;
+    int i;
+
+    tl.tape = tape_new();
+    tl.nodes = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+        NULL, free);
+    tl.alloc = 16;
+    tl.used = calloc(tl.alloc, 1);
+    tl.released_level = malloc(sizeof(int) * tl.alloc);
+    tl.released_task = malloc(sizeof(int) * tl.alloc);
+    assert(tl.used && tl.released_level && tl.released_task);
+    for (i = 0; i < tl.alloc; i++)
+        tl.released_level[i] = -1;
+    tl.level = tl.task = 0;
+    tl.unshared = 0;
+
+    tl.tape->vars = malloc(sizeof(struct tape_task) * (count ? count : 1));
+    assert(tl.tape->vars);
+
+    /* Count readers up front, so shared nodes keep their slot until all
+     * variables reading them have been lowered.
+     */
+    for (i = 0; i < count; i++)
+        _tape_count(&tl, vars[i]->vargraph);
+
+    if (pool_threads() > 1 && tail > 1) {
+        _tape_lower_tasks(&tl, vars, tail);
+
+        /* Per sample instructions run after all tasks */
+        tl.level = tl.tape->nlevels;
+        tl.task = -1;
+        tl.unshared = 0;
+        i = tail;
+    } else {
+        i = 0;
+    }
+
+    for (; i < count; i++) {
+        if (i == tail)
+            tl.tape->tail = tl.tape->size;
+        _tape_lower_var(&tl, vars[i]);
+    }
+
+    /* Publish next values, after all variables have been evaluated */
+    for (i = 0; i < count; i++) {
+        if (!vars[i]->recursive)
+            continue;
+        top = _tape_emit(tl.tape, TOP_COMMIT, -1);
+        top->data.var = vars[i];
+    }
+
+    g_hash_table_destroy(tl.nodes);
+    free(tl.used);
+    free(tl.released_level);
+    free(tl.released_task);
+
+    _tape_finish(tl.tape);
+
+    return tl.tape;
+}
+
+/* Compute the level of the task lowering var
+ *
+ * Nodes are lowered by the first variable reaching them in evaluation
+ * order (their owner), other variables reading them are placed in a later
+ * level. The same holds for variables read, owners is updated with all
+ * nodes owned by var. Leaves are not shared and have no owner.
+ * Delays of the same signal share a line which every tap writes to, so
+ * the line is owned like a node: taps in other variables come later.
+ */
+static void _tape_level(GHashTable *owners, GHashTable *levels,
+    soundscript_var var, msynth_modifier mod, int *level)
+{
+    soundscript_var owner;
+    tf_delay_line line;
+    int l;
+
+    if (mod->type == MSMT_CONSTANT)
+        return;
+
+    owner = _tape_is_leaf(mod) ? NULL : g_hash_table_lookup(owners, mod);
+    if (owner) {
+        if (owner != var) {
+            l = GPOINTER_TO_INT(g_hash_table_lookup(levels, owner));
+            if (l > *level)
+                *level = l;
+        }
+        return;
+    }
+    if (!_tape_is_leaf(mod))
+        g_hash_table_insert(owners, mod, var);
+
+    line = ssb_is_delay(mod) ? ((tf_delay_info)mod->storage)->line : NULL;
+    if (line) {
+        owner = g_hash_table_lookup(owners, line);
+        if (!owner) {
+            g_hash_table_insert(owners, line, var);
+        } else if (owner != var) {
+            l = GPOINTER_TO_INT(g_hash_table_lookup(levels, owner));
+            if (l > *level)
+                *level = l;
+        }
+    }
+
+    switch(mod->type) {
+        case MSMT_VARIABLE:
+            /* Levels are stored plus one, variables evaluated sample by
+             * sample are not found and impose no level.
+             */
+            l = GPOINTER_TO_INT(g_hash_table_lookup(levels,
+                mod->data.variable.var));
+            if (l > *level)
+                *level = l;
+            break;
+
+        case MSMT_NODE1:
+            _tape_level(owners, levels, var, mod->data.node.in, level);
+            break;
+
+        case MSMT_NODE2:
+            _tape_level(owners, levels, var, mod->data.node2.a, level);
+            _tape_level(owners, levels, var, mod->data.node2.b, level);
+            break;
+
+        default:;
+    }
+
+    return;
+}
+
+/* Lower the block variables as tasks, ordered by level */
+static void _tape_lower_tasks(struct tape_lowering *tl,
+    soundscript_var *vars, int count)
+{
+    synth_tape tape = tl->tape;
+    GHashTable *owners, *levels;
+    int i, l, *level, *first;
+
+    owners = g_hash_table_new(g_direct_hash, g_direct_equal);
+    levels = g_hash_table_new(g_direct_hash, g_direct_equal);
+    level = malloc(sizeof(int) * count);
+    assert(level);
+
+    /* Levels follow from the evaluation order */
+    for (i = 0; i < count; i++) {
+        level[i] = 0;
+        _tape_level(owners, levels, vars[i], vars[i]->vargraph, level + i);
+        g_hash_table_insert(levels, vars[i], GINT_TO_POINTER(level[i] + 1));
+
+        if (level[i] >= tape->nlevels)
+            tape->nlevels = level[i] + 1;
+    }
+
+    /* Count tasks per level, first[l] becomes the first task of level l */
+    first = calloc(tape->nlevels + 1, sizeof(int));
+    assert(first);
+    for (i = 0; i < count; i++)
+        first[level[i] + 1]++;
+    for (l = 0; l < tape->nlevels; l++)
+        first[l + 1] += first[l];
+
+    tape->levels = malloc(sizeof(int) * (tape->nlevels + 1));
+    tape->tasks = malloc(sizeof(struct tape_task) * count);
+    assert(tape->levels && tape->tasks);
+    memcpy(tape->levels, first, sizeof(int) * (tape->nlevels + 1));
+
+    /* Lower level by level, within a level in evaluation order */
+    tl->unshared = 1;
+    for (l = 0; l < tape->nlevels; l++) {
+        tl->level = l;
+        for (i = 0; i < count; i++) {
+            if (level[i] != l)
+                continue;
+
+            tl->task = first[l];
+            tape->tasks[tl->task].start = tape->size;
+            tape->tasks[tl->task].var = vars[i];
+            _tape_lower_var(tl, vars[i]);
+            tape->tasks[first[l]++].end = tape->size;
+        }
+    }
+
+    free(first);
+    free(level);
+    g_hash_table_destroy(owners);
+    g_hash_table_destroy(levels);
+
+    return;
+}
+
+/* Finish tape, must be called before running it */
+static void _tape_finish(synth_tape tape)
+{
+    if (tape->tail == -1)
+        tape->tail = tape->size;
+
+    free(tape->scratch);
+    tape->scratch = malloc(sizeof(float) * MSYNTH_BLOCK * tape->slots);
+    assert(tape->scratch);
+
+    /* Compile block instructions, the interpreter is used on failure */
+    jit_free(tape->native);
+    tape->native = NULL;
+    if (engine == TAPE_ENGINE_NATIVE && !tape->tasks)
+        tape->native = jit_compile(tape->ops, tape->tail);
+
+    return;
+}
+
+/* Select engine for tapes finished from now on
+ *
+ * Returns 0 on success, -1 when the engine is not available.
+ */
+int tape_set_engine(int new_engine)
+{
+    if (new_engine == TAPE_ENGINE_NATIVE && !jit_supported())
+        return -1;
+
+    engine = new_engine;
+    return 0;
+}
+
+/* Return the currently selected engine */
+int tape_get_engine(void)
+{
+    return engine;
+}
+
+/* Execute instructions
+ *
+ * offset: Frame within the current block the instructions are executed for,
+ *         variable blocks are read and written starting at this frame.
+ */
+void tape_exec(struct tape_op *op, struct tape_op *end,
+    float *scratch, struct sampleclock sc, int offset, int frames)
+{
+    int i;
+    float *dst, *a, *b;
+
+    for (; op < end; op++) {
+        dst = scratch + op->dst * MSYNTH_BLOCK;
+        a = scratch + op->a * MSYNTH_BLOCK;
+        b = scratch + op->b * MSYNTH_BLOCK;
+
+        switch (op->op) {
+            case TOP_CONSTANT:
+                for (i = 0; i < frames; i++)
+                    dst[i] = op->data.constant;
+                break;
+
+            case TOP_VARIABLE:
+                memcpy(dst, op->data.var->block + offset,
+                    sizeof(float) * frames);
+                break;
+
+            case TOP_LOAD:
+                memcpy(dst, a + offset, sizeof(float) * frames);
+                break;
+
+            case TOP_RECURSIVE:
+                for (i = 0; i < frames; i++)
+                    dst[i] = op->data.var->last_eval;
+                break;
+
+            case TOP_NODE0:
+                op->data.func0(sc, op->storage, dst, frames);
+                break;
+
+            case TOP_NODE1:
+                op->data.func1(sc, op->storage, dst, a, frames);
+                break;
+
+            case TOP_NODE2:
+                op->data.func2(sc, op->storage, dst, a, b, frames);
+                break;
+
+            case TOP_ADD:
+                for (i = 0; i < frames; i++)
+                    dst[i] = a[i] + b[i];
+                break;
+
+            case TOP_SUB:
+                for (i = 0; i < frames; i++)
+                    dst[i] = a[i] - b[i];
+                break;
+
+            case TOP_MUL:
+                for (i = 0; i < frames; i++)
+                    dst[i] = a[i] * b[i];
+                break;
+
+            case TOP_DIV:
+                for (i = 0; i < frames; i++)
+                    dst[i] = b[i] == 0.0f ? 0.0f : a[i] / b[i];
+                break;
+
+            case TOP_STORE:
+                memcpy(op->data.var->block + offset, a,
+                    sizeof(float) * frames);
+                op->data.var->last_eval = a[frames - 1];
+                break;
+
+            case TOP_STORE_RECURSIVE:
+                memcpy(op->data.var->block + offset, a,
+                    sizeof(float) * frames);
+                op->data.var->recursive_next = SYNTH_FLUSH(a[frames - 1]);
+                break;
+
+            case TOP_COMMIT:
+                op->data.var->last_eval = op->data.var->recursive_next;
+                break;
+
+            default:;
+        }
+    }
+
+    return;
+}
+
+/* Run tape for a block of frames (at most MSYNTH_BLOCK) */
+void tape_run(synth_tape tape, struct sampleclock sc, int frames)
+{
+    int f, l;
+    struct jit_ctx ctx;
+    struct tape_job job;
+    struct tape_op
+        *tail = tape->ops + tape->tail,
+        *end = tape->ops + tape->size;
+
+    if (__atomic_load_n(&profiled, __ATOMIC_ACQUIRE) == tape) {
+        _tape_run_profiled(tape, sc, frames);
+        return;
+    }
+
+    /* Block instructions */
+    if (tape->tasks) {
+        job.tape = tape;
+        job.sc = sc;
+        job.frames = frames;
+        for (l = 0; l < tape->nlevels; l++) {
+            job.first = tape->levels[l];
+            pool_run(_tape_run_task, &job,
+                tape->levels[l + 1] - tape->levels[l]);
+        }
+    } else if (tape->native) {
+        ctx.scratch = tape->scratch;
+        ctx.frames = frames;
+        ctx.sc = sc;
+        tape->native->func(&ctx);
+    } else {
+        tape_exec(tape->ops, tail, tape->scratch, sc, 0, frames);
+    }
+
+    /* No need to continue if there is no feedback */
+    if (tail == end)
+        return;
+
+    /* Per sample instructions */
+    for (f = 0; f < frames; f++) {
+        tape_exec(tail, end, tape->scratch, sc, f, 1);
+        sc = sc_advance(sc, 1);
+    }
+
+    return;
+}
+
+/* Run the block instructions of a single task */
+static void _tape_run_task(void *arg, int index)
+{
+    struct tape_job *job = arg;
+    struct tape_task *task = job->tape->tasks + job->first + index;
+
+    tape_exec(job->tape->ops + task->start, job->tape->ops + task->end,
+        job->tape->scratch, job->sc, 0, job->frames);
+
+    return;
+}
+
+/* -------- Profiling -------- */
+
+/* Monotonic time in nanoseconds */
+static unsigned long long _tape_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Start profiling a published tape, instead of any tape profiled before
+ *
+ * The profile of the tape is reset. Must be called by the thread
+ * publishing tapes.
+ */
+void tape_profile_start(synth_tape tape)
+{
+    unsigned long long t, least = ~0ULL;
+    int i;
+
+    __atomic_store_n(&profiled, NULL, __ATOMIC_SEQ_CST);
+
+    if (!tape->ticks) {
+        tape->ticks = calloc(tape->size ? tape->size : 1,
+            sizeof(unsigned long long));
+        assert(tape->ticks);
+    } else {
+        memset(tape->ticks, 0, sizeof(unsigned long long) * tape->size);
+    }
+    tape->frames = 0;
+
+    /* Ticks spent reading the counter, not counted for instructions */
+    for (i = 0; i < 1000; i++) {
+        t = TAPE_TICKS();
+        t = TAPE_TICKS() - t;
+        if (t < least)
+            least = t;
+    }
+    profile_overhead = least;
+
+    profile_ns[0] = _tape_ns();
+    profile_ticks[0] = TAPE_TICKS();
+    __atomic_store_n(&profiled, tape, __ATOMIC_RELEASE);
+
+    return;
+}
+
+/* Stop profiling */
+void tape_profile_stop(void)
+{
+    __atomic_store_n(&profiled, NULL, __ATOMIC_SEQ_CST);
+    profile_ns[1] = _tape_ns();
+    profile_ticks[1] = TAPE_TICKS();
+
+    return;
+}
+
+/* Return the amount of frames profiled */
+long long tape_profile_frames(synth_tape tape)
+{
+    return __atomic_load_n(&tape->frames, __ATOMIC_RELAXED);
+}
+
+/* Run a block of frames, like tape_run, timing every instruction */
+static void _tape_run_profiled(synth_tape tape, struct sampleclock sc,
+    int frames)
+{
+    struct tape_job job;
+    int f, l;
+
+    if (tape->tasks) {
+        job.tape = tape;
+        job.sc = sc;
+        job.frames = frames;
+        for (l = 0; l < tape->nlevels; l++) {
+            job.first = tape->levels[l];
+            pool_run(_tape_run_task_profiled, &job,
+                tape->levels[l + 1] - tape->levels[l]);
+        }
+    } else {
+        _tape_exec_profiled(tape, 0, tape->tail, sc, 0, frames);
+    }
+
+    for (f = 0; f < frames && tape->tail < tape->size; f++) {
+        _tape_exec_profiled(tape, tape->tail, tape->size, sc, f, 1);
+        sc = sc_advance(sc, 1);
+    }
+
+    __atomic_store_n(&tape->frames, tape->frames + frames,
+        __ATOMIC_RELAXED);
+
+    return;
+}
+
+/* Run the block instructions of a single task, timing every instruction */
+static void _tape_run_task_profiled(void *arg, int index)
+{
+    struct tape_job *job = arg;
+    struct tape_task *task = job->tape->tasks + job->first + index;
+
+    _tape_exec_profiled(job->tape, task->start, task->end, job->sc, 0,
+        job->frames);
+
+    return;
+}
+
+/* Execute instructions start up to end, like tape_exec, adding the ticks
+ * spent in every instruction to its profile
+ */
+static void _tape_exec_profiled(synth_tape tape, int start, int end,
+    struct sampleclock sc, int offset, int frames)
+{
+    unsigned long long t;
+    int i;
+
+    for (i = start; i < end; i++) {
+        t = TAPE_TICKS();
+        tape_exec(tape->ops + i, tape->ops + i + 1, tape->scratch, sc,
+            offset, frames);
+        t = TAPE_TICKS() - t;
+
+        t = t > profile_overhead ? t - profile_overhead : 0;
+        __atomic_store_n(tape->ticks + i, tape->ticks[i] + t,
+            __ATOMIC_RELAXED);
+    }
+
+    return;
+}
+
+/* Return the name of the node type an instruction was lowered from */
+static const char *_tape_op_name(struct tape_op *op)
+{
+    const char *name;
+
+    switch (op->op) {
+        case TOP_CONSTANT: return "constant";
+        case TOP_VARIABLE: return "variable";
+        case TOP_RECURSIVE: return "recursive variable";
+        case TOP_LOAD: return "load";
+        case TOP_ADD: return "add";
+        case TOP_SUB: return "sub";
+        case TOP_MUL: return "mul";
+        case TOP_DIV: return "div";
+        case TOP_STORE:
+        case TOP_STORE_RECURSIVE: return "store";
+        case TOP_COMMIT: return "commit";
+
+        /* Block functions of any arity share the representation */
+        case TOP_NODE0:
+        case TOP_NODE1:
+        case TOP_NODE2:
+            name = ssb_func_name(op->data.func1);
+            return name ? name : "function";
+
+        default: return "unknown";
+    }
+}
+
+/* Order profiles by descending time */
+static int _tape_profile_cmp(const void *a, const void *b)
+{
+    const struct tape_profile *pa = a, *pb = b;
+
+    if (pa->ticks != pb->ticks)
+        return pa->ticks < pb->ticks ? 1 : -1;
+    return strcmp(pa->name, pb->name);
+}
+
+/* Print a ranked table of profiles */
+static void _tape_profile_table(const char *title, struct tape_profile *p,
+    int n, double ns, unsigned long long total)
+{
+    int i;
+
+    qsort(p, n, sizeof(struct tape_profile), _tape_profile_cmp);
+
+    printf("%-20s %6s %10s %7s\n", title, "nodes", "ns/sample", "share");
+    for (i = 0; i < n; i++)
+        printf("%-20s %6i %10.2f %6.1f%%\n", p[i].name, p[i].nodes,
+            p[i].ticks * ns, total ? 100.0 * p[i].ticks / total : 0.0);
+
+    return;
+}
+
+/* Print the profile of a tape, by variable and by node type */
+void tape_profile_print(synth_tape tape)
+{
+    struct tape_profile *vars, *types, *p;
+    GHashTable *names;
+    unsigned long long total = 0, ticks;
+    long long frames = tape_profile_frames(tape);
+    const char *name;
+    double ns;
+    int i, j, ntypes = 0;
+
+    if (!tape->ticks || !frames) {
+        puts("Nothing was profiled");
+        return;
+    }
+
+    /* Nanoseconds per tick and frame */
+    ticks = profile_ticks[1] - profile_ticks[0];
+    ns = ticks ? (double)(profile_ns[1] - profile_ns[0]) / ticks : 1.0;
+    ns /= frames;
+
+    for (i = 0; i < tape->size; i++)
+        total += __atomic_load_n(tape->ticks + i, __ATOMIC_RELAXED);
+
+    /* Variables, without the instructions storing them (the last of each
+     * variable), those are only counted by node type */
+    vars = calloc(tape->nvars ? tape->nvars : 1, sizeof(struct tape_profile));
+    assert(vars);
+    for (i = 0; i < tape->nvars; i++) {
+        name = ssv_get_name(tape->vars[i].var);
+        vars[i].name = name ? name : "?";
+        vars[i].nodes = tape->vars[i].end - tape->vars[i].start - 1;
+        for (j = tape->vars[i].start; j < tape->vars[i].end - 1; j++)
+            vars[i].ticks += __atomic_load_n(tape->ticks + j,
+                __ATOMIC_RELAXED);
+    }
+
+    /* Node types, every name is a static string */
+    names = g_hash_table_new(g_str_hash, g_str_equal);
+    types = calloc(tape->size ? tape->size : 1, sizeof(struct tape_profile));
+    assert(types);
+    for (i = 0; i < tape->size; i++) {
+        name = _tape_op_name(tape->ops + i);
+        p = g_hash_table_lookup(names, name);
+        if (!p) {
+            p = types + ntypes++;
+            p->name = name;
+            g_hash_table_insert(names, (gpointer)name, p);
+        }
+        p->nodes++;
+        p->ticks += __atomic_load_n(tape->ticks + i, __ATOMIC_RELAXED);
+    }
+    g_hash_table_destroy(names);
+
+    printf("Profiled %lld samples, %.2f ns/sample%s\n", frames, total * ns,
+        tape->native ? " (interpreted while profiling)" : "");
+    _tape_profile_table("variable", vars, tape->nvars, ns, total);
+    _tape_profile_table("node type", types, ntypes, ns, total);
+
+    free(vars);
+    free(types);
+
+    return;
+}
@@ -0,0 +1,99 @@
+/* Sound graph instruction tape */
+
+/* Tape opcodes */
+#define TOP_CONSTANT        0   /* dst = constant */
+#define TOP_VARIABLE        1   /* dst = variable block */
+#define TOP_RECURSIVE       2   /* dst = previous recursive variable value */
+#define TOP_NODE0           3   /* dst = func() */
+#define TOP_NODE1           4   /* dst = func(a) */
+#define TOP_NODE2           5   /* dst = func(a, b) */
+#define TOP_ADD             6   /* dst = a + b */
+#define TOP_SUB             7   /* dst = a - b */
+#define TOP_MUL             8   /* dst = a * b */
+#define TOP_DIV             9   /* dst = a / b (0 when b is 0) */
+#define TOP_STORE           10  /* variable block = a */
+#define TOP_STORE_RECURSIVE 11  /* variable block = a, store next value */
+#define TOP_COMMIT          12  /* publish next value of recursive variable */
+#define TOP_LOAD            13  /* dst = block instruction slot a */
+
+/* Tape instruction
+ *
+ * dst, a and b are slot indices, every slot holds MSYNTH_BLOCK samples.
+ * storage points to the local storage of the graph node this instruction
+ * was lowered from.
+ */
+struct tape_op {
+    int op;
+    int dst, a, b;
+    void **storage;
+
+    union _tape_op_data {
+        float constant;
+        soundscript_var var;
+        msynth_blockfunc0 func0;
+        msynth_blockfunc func1;
+        msynth_blockfunc2 func2;
+    } data;
+};
+
+/* Instructions lowered from a single variable */
+struct tape_task {
+    int start, end;
+    soundscript_var var;
+};
+
+/* Instruction tape
+ *
+ * All instructions before 'tail' are executed once per block, the
+ * remaining instructions are executed once for every frame in a block.
+ */
+typedef struct _synth_tape {
+    struct tape_op *ops;
+    int size, alloc;
+    int tail;
+
+    /* Slot buffers */
+    int slots;
+    float *scratch;
+
+    /* Native code for the block instructions, if compiled */
+    struct _jit_code *native;
+
+    /* Parallel evaluation of the block instructions, NULL if not used.
+     * Level i consists of the tasks from levels[i] up to levels[i + 1],
+     * tasks only read results of tasks in earlier levels.
+     */
+    struct tape_task *tasks;
+    int *levels;
+    int nlevels;
+
+    /* Instructions lowered from every variable, in tape order */
+    struct tape_task *vars;
+    int nvars;
+
+    /* Profile, NULL when never profiled: time spent in every instruction
+     * (in cycle counter ticks) and the amount of frames profiled
+     */
+    unsigned long long *ticks;
+    long long frames;
+} *synth_tape;
+
+/* Tape engines */
+#define TAPE_ENGINE_INTERPRETER 0
+#define TAPE_ENGINE_NATIVE      1
+
+/* Tape interface */
+synth_tape tape_new(void);
+void tape_free(synth_tape tape);
+synth_tape tape_lower(soundscript_var *vars, int count, int tail);
+void tape_run(synth_tape tape, struct sampleclock sc, int frames);
+void tape_exec(struct tape_op *op, struct tape_op *end,
+    float *scratch, struct sampleclock sc, int offset, int frames);
+int tape_set_engine(int engine);
+int tape_get_engine(void);
+
+/* Tape profiling */
+void tape_profile_start(synth_tape tape);
+void tape_profile_stop(void);
+long long tape_profile_frames(synth_tape tape);
+void tape_profile_print(synth_tape tape);
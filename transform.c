@@ -1,4 +1,7 @@
 /* Various basic sound transforms */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 #include "sampleclock.h"
@@ -61,19 +64,102 @@ float tf_chipify(struct sampleclock sc, void **storage, float in)
 float tf_delay(struct sampleclock sc, void **storage, float in)
 {
     tf_delay_info di = (tf_delay_info)*storage;
-    float
-        *history = (float*)(di + 1),
-        r;
-
-    if (di->delay) {
-        r = history[di->pos];
-        history[di->pos] = in;
-        di->pos = (di->pos + 1) % di->delay;
-    } else {
-        r = in;
+    tf_delay_line line = di->line;
+    int mask;
+
+    if (!di->delay)
+        return in;
+
+    mask = line->size - 1;
+    if (sc.samples >= line->written) {
+        line->history[sc.samples & mask] = SYNTH_FLUSH(in);
+        line->written = sc.samples + 1;
+    }
+
+    return line->history[(sc.samples - di->delay) & mask];
+}
+
+/* Return ring size for a delay line with taps of up to delay samples
+ *
+ * A block is written before any of it is read, so the ring holds a block
+ * on top of the longest delay.
+ */
+static int _tf_delay_size(int delay)
+{
+    int size = 1;
+
+    while (size < delay + MSYNTH_BLOCK)
+        size <<= 1;
+
+    return size;
+}
+
+/* Allocate silent history of size samples */
+static float *_tf_delay_history(int size)
+{
+    float *history = calloc(size, sizeof(float));
+
+    if (!history) {
+        perror("_tf_delay_history.calloc");
+        exit(1);
+    }
+
+    return history;
+}
+
+/* Create delay line for a single tap of delay samples */
+tf_delay_line tf_delay_line_new(int delay)
+{
+    tf_delay_line line = malloc(sizeof(struct _tf_delay_line));
+
+    if (!line) {
+        perror("tf_delay_line_new.malloc");
+        exit(1);
+    }
+
+    line->refs = 1;
+    line->size = _tf_delay_size(delay);
+    line->written = 0;
+    line->history = _tf_delay_history(line->size);
+
+    return line;
+}
+
+/* Release reference to delay line */
+void tf_delay_line_release(tf_delay_line line)
+{
+    if (--line->refs > 0)
+        return;
+
+    free(line->history);
+    free(line);
+
+    return;
+}
+
+/* Move tap di onto line, which grows to fit the tap if necessary
+ *
+ * NOTE: Only valid while neither line was evaluated yet, the history of
+ *       a grown line is not preserved.
+ */
+void tf_delay_share(tf_delay_info di, tf_delay_line line)
+{
+    int size = _tf_delay_size(di->delay);
+
+    if (di->line == line)
+        return;
+
+    if (line->size < size) {
+        free(line->history);
+        line->size = size;
+        line->history = _tf_delay_history(size);
     }
 
-    return r;
+    line->refs++;
+    tf_delay_line_release(di->line);
+    di->line = line;
+
+    return;
 }
 
 /* Minimum of input signals */
@@ -115,3 +201,77 @@ float tf_ceil(struct sampleclock sc, void **storage, float in)
     return ceilf(in);
 }
 
+
+/* -------- Block transforms -------- */
+
+/* Generate the block variant of a single input transform
+ *
+ * Every sample is passed through the per-sample transform, this keeps both
+ * evaluation paths identical. Since out may alias in, every input sample
+ * is read before its output is written.
+ */
+#define TF_BLOCK(NAME) \
+void NAME ## _block(struct sampleclock sc, void **storage, \
+    float *out, float *in, int frames) \
+{ \
+    int i; \
+    for (i = 0; i < frames; i++) \
+        out[i] = NAME(sc, storage, in[i]); \
+}
+
+/* Generate the block variant of a dual input transform */
+#define TF_BLOCK2(NAME) \
+void NAME ## _block(struct sampleclock sc, void **storage, \
+    float *out, float *a, float *b, int frames) \
+{ \
+    int i; \
+    for (i = 0; i < frames; i++) \
+        out[i] = NAME(sc, storage, a[i], b[i]); \
+}
+
+TF_BLOCK2(tf_mul)
+TF_BLOCK2(tf_add)
+TF_BLOCK2(tf_div)
+TF_BLOCK2(tf_sub)
+
+TF_BLOCK(tf_chipify)
+
+TF_BLOCK2(tf_min)
+TF_BLOCK2(tf_max)
+TF_BLOCK(tf_abs)
+TF_BLOCK2(tf_clamp)
+TF_BLOCK(tf_floor)
+TF_BLOCK(tf_ceil)
+
+/* Block of delayed samples
+ *
+ * The whole input block is written to the line first (unless another tap
+ * did so already), then all taps read from the line alone, so out may
+ * alias in.
+ */
+void tf_delay_block(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames)
+{
+    tf_delay_info di = (tf_delay_info)*storage;
+    tf_delay_line line = di->line;
+    int64_t t;
+    int i, mask;
+
+    if (!di->delay) {
+        if (out != in)
+            memcpy(out, in, sizeof(float) * frames);
+        return;
+    }
+
+    mask = line->size - 1;
+    for (t = line->written > sc.samples ? line->written : sc.samples;
+            t < sc.samples + frames; t++)
+        line->history[t & mask] = SYNTH_FLUSH(in[t - sc.samples]);
+    if (line->written < sc.samples + frames)
+        line->written = sc.samples + frames;
+
+    for (i = 0; i < frames; i++)
+        out[i] = line->history[(sc.samples + i - di->delay) & mask];
+
+    return;
+}
@@ -1,8 +1,22 @@
 /* Basic synth transforms */
 
 /* transform storage structures */
+
+/* Delay line, a ring buffer shared by all delays (taps) of one signal
+ *
+ * The ring holds a power of two samples, enough for the longest tap and a
+ * block. Each sample is written once, by whichever tap is evaluated first.
+ */
+typedef struct _tf_delay_line {
+    int refs;
+    int size;
+    int64_t written; /* Samples before this one have been written */
+    float *history;
+} *tf_delay_line;
+
 typedef struct _tf_delay_info {
-    int delay, pos;
+    int delay;
+    tf_delay_line line; /* NULL for a delay of 0 */
 } *tf_delay_info;
 
 /* transform functions */
@@ -21,3 +35,35 @@ float tf_clamp(struct sampleclock sc, void **storage, float a, float b);
 float tf_floor(struct sampleclock sc, void **storage, float in);
 float tf_ceil(struct sampleclock sc, void **storage, float in);
 
+/* delay lines */
+tf_delay_line tf_delay_line_new(int delay);
+void tf_delay_line_release(tf_delay_line line);
+void tf_delay_share(tf_delay_info di, tf_delay_line line);
+
+/* block transform functions */
+void tf_mul_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+void tf_add_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+void tf_div_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+void tf_sub_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+
+void tf_delay_block(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames);
+void tf_chipify_block(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames);
+
+void tf_min_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+void tf_max_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+void tf_abs_block(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames);
+void tf_clamp_block(struct sampleclock sc, void **storage,
+    float *out, float *a, float *b, int frames);
+void tf_floor_block(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames);
+void tf_ceil_block(struct sampleclock sc, void **storage,
+    float *out, float *in, int frames);